@@ -6,8 +6,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -25,28 +27,116 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block handed out by the perf tier, mixed with the
+ * address of the block
+ */
+#define MAGICPERF 0xcafebeef
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
+/* Bytes of header and footer around a block of the check and paranoid tiers */
+#define BLOCK_OVERHEAD (sizeof(block_element_t) + sizeof(size_t))
+
+/* Header placed in front of a block handed out by the perf tier. Its marker
+ * sits where block_element_t keeps magic_header, so test_free() can tell the
+ * two kinds of block apart whichever tier is selected when it is called.
+ */
+typedef struct {
+    size_t payload_size;
+    size_t magic; /* perf_tag() of the block */
+    unsigned char payload[0];
+} perf_block_t;
+
+/* The perf tier rounds blocks up to a multiple of PERF_GRAIN bytes and keeps
+ * a free list per size. Blocks of a class are carved from PERF_CHUNK byte
+ * chunks, which are never returned to the system; larger blocks go to malloc.
+ */
+#define PERF_GRAIN 16
+#define PERF_CLASSES 32
+#define PERF_CHUNK (64 * 1024)
+
+static perf_block_t *perf_free_list[PERF_CLASSES];
+static unsigned char *perf_cursor = NULL;
+static size_t perf_left = 0;
+static void *perf_chunks = NULL; /* Chained through their first word */
+static size_t perf_live = 0;
+
+/* Marker of a live perf block. As it depends on where the block is, a header
+ * copied elsewhere, or a payload which happens to hold MAGICPERF, is not
+ * taken for one.
+ */
+static inline size_t perf_tag(const perf_block_t *b)
+{
+    return MAGICPERF ^ (uintptr_t) b;
+}
+
+/* Size class of a perf block, PERF_CLASSES or more if it comes from malloc */
+static inline size_t perf_class(size_t size)
+{
+    return (size + sizeof(perf_block_t) + PERF_GRAIN - 1) / PERF_GRAIN;
+}
+
+/* Sampled allocations are placed in a pool of GUARD_SLOTS pages, each with a
+ * PROT_NONE page on both sides. The payload ends exactly at the following
+ * guard page, so an overrun faults on its first byte past the block, and a
+ * freed slot stays inaccessible until it is reused. No header is needed: a
+ * pointer inside the pool identifies its slot. Freed slots are reused oldest
+ * first to catch late accesses for as long as possible.
+ */
+#define GUARD_SLOTS 256
+
+/* Bytes a sampled block of the given size takes beyond its payload. Adjacent
+ * slots share the guard page between them, so each slot is charged its own
+ * page and the guard page after it; the pool's leading guard page is left out.
+ */
+#define GUARD_OVERHEAD(size) (2 * page_size - (size))
+
+static unsigned char *guard_pool = NULL; /* Starts with a guard page */
+static size_t guard_pool_size = 0;
+static size_t page_size = 0;
+static size_t guard_size[GUARD_SLOTS];  /* Payload size of each live slot */
+static bool guard_live[GUARD_SLOTS];
+static size_t guard_free[GUARD_SLOTS]; /* Queue of slots ready for reuse */
+static size_t guard_free_head = 0, guard_free_count = 0;
+static unsigned guard_rate = 0;      /* Mean allocations between samples */
+static unsigned guard_countdown = 0; /* Allocations until the next sample */
+static size_t guard_live_count = 0;
+
+/* Represent allocated blocks as an open-addressing hash set keyed by block
+ * address, using linear probing. The capacity is a power of two and the set
+ * is kept at most half full, so looking up, adding and removing a block all
+ * take constant expected time.
+ */
+#define REGISTRY_MIN_CAPACITY 1024
+
+static block_element_t **registry = NULL;
+static size_t registry_capacity = 0;
 static size_t allocated_count = 0;
 
+/* Bytes requested by live blocks, and the most live at once since the peak
+ * was last reset. overhead_bytes counts what the harness adds to the live
+ * blocks: guards, headers, rounding, and for a sampled block the unused part
+ * of its page and the PROT_NONE page after it.
+ */
+static size_t allocated_bytes = 0;
+static size_t overhead_bytes = 0;
+static size_t peak_bytes = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+static harness_tier_t tier = HARNESS_PARANOID;
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -67,11 +157,113 @@ typedef enum {
 
 /* Internal functions */
 
+static inline void account_alloc(size_t size, size_t overhead)
+{
+    allocated_bytes += size;
+    overhead_bytes += overhead;
+    if (allocated_bytes > peak_bytes)
+        peak_bytes = allocated_bytes;
+}
+
+static inline void account_free(size_t size, size_t overhead)
+{
+    allocated_bytes -= size;
+    overhead_bytes -= overhead;
+}
+
+/* Home slot of block b in the registry */
+static inline size_t registry_slot(const block_element_t *b)
+{
+    /* Fibonacci hashing; the low bits of a block address carry no entropy */
+    uint64_t h = ((uintptr_t) b >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h >> 32) & (registry_capacity - 1);
+}
+
+/* Return the registry slot holding b, or the empty slot where it would go */
+static size_t registry_find(const block_element_t *b)
+{
+    size_t i = registry_slot(b);
+    while (registry[i] && registry[i] != b)
+        i = (i + 1) & (registry_capacity - 1);
+    return i;
+}
+
+static bool registry_grow()
+{
+    size_t old_capacity = registry_capacity;
+    block_element_t **old = registry;
+
+    size_t capacity =
+        old_capacity ? old_capacity << 1 : REGISTRY_MIN_CAPACITY;
+    block_element_t **slots = calloc(capacity, sizeof(block_element_t *));
+    if (!slots)
+        return false;
+
+    registry = slots;
+    registry_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i])
+            registry[registry_find(old[i])] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static bool registry_add(block_element_t *b)
+{
+    if (2 * (allocated_count + 1) > registry_capacity && !registry_grow())
+        return false;
+
+    registry[registry_find(b)] = b;
+    allocated_count++;
+    account_alloc(b->payload_size, BLOCK_OVERHEAD);
+    return true;
+}
+
+static bool registry_contains(const block_element_t *b)
+{
+    return registry && registry[registry_find(b)] == b;
+}
+
+/* Remove b from the registry. Entries following it in the same probe run
+ * are shifted back, so no tombstones are needed.
+ */
+static void registry_remove(const block_element_t *b)
+{
+    if (!registry)
+        return;
+
+    size_t mask = registry_capacity - 1;
+    size_t hole = registry_find(b);
+    if (!registry[hole])
+        return;
+
+    for (size_t i = (hole + 1) & mask; registry[i]; i = (i + 1) & mask) {
+        size_t home = registry_slot(registry[i]);
+        /* Move the entry unless its home lies cyclically in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            registry[hole] = registry[i];
+            hole = i;
+        }
+    }
+    registry[hole] = NULL;
+    allocated_count--;
+    account_free(b->payload_size, BLOCK_OVERHEAD);
+}
+
+/* Bytes a perf block of the given size occupies beyond its payload */
+static inline size_t perf_overhead(size_t size)
+{
+    size_t class = perf_class(size);
+    return class < PERF_CLASSES ? class * PERF_GRAIN - size
+                                : sizeof(perf_block_t);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return fail_probability > 0 &&
+           rand_next() % 100 < (uint64_t) fail_probability;
 }
 
 /* Find header of block, given its payload.
@@ -88,13 +280,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!registry_contains(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -122,6 +308,177 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
+static perf_block_t *perf_carve(size_t bytes)
+{
+    if (perf_left < bytes) {
+        unsigned char *chunk = malloc(PERF_CHUNK);
+        if (!chunk)
+            return NULL;
+        *(void **) chunk = perf_chunks;
+        perf_chunks = chunk;
+        perf_cursor = chunk + PERF_GRAIN;
+        perf_left = PERF_CHUNK - PERF_GRAIN;
+    }
+
+    perf_block_t *b = (perf_block_t *) perf_cursor;
+    perf_cursor += bytes;
+    perf_left -= bytes;
+    return b;
+}
+
+/* Allocation in the perf tier: no guards, no poisoning, only a count */
+static void *perf_alloc(alloc_t alloc_type, size_t size)
+{
+    size_t class = perf_class(size);
+    perf_block_t *b;
+    if (class >= PERF_CLASSES) {
+        b = malloc(size + sizeof(perf_block_t));
+    } else if (perf_free_list[class]) {
+        b = perf_free_list[class];
+        perf_free_list[class] = *(perf_block_t **) b->payload;
+    } else {
+        b = perf_carve(class * PERF_GRAIN);
+    }
+
+    if (!b) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+
+    b->payload_size = size;
+    b->magic = perf_tag(b);
+    perf_live++;
+    allocated_count++;
+    account_alloc(size, perf_overhead(size));
+    if (alloc_type == TEST_CALLOC)
+        memset(b->payload, 0, size);
+    return b->payload;
+}
+
+/* Whether b lies in one of the chunks perf blocks are carved from */
+static bool perf_owns(const perf_block_t *b)
+{
+    for (unsigned char *chunk = perf_chunks; chunk; chunk = *(void **) chunk) {
+        if ((unsigned char *) b >= chunk + PERF_GRAIN &&
+            (unsigned char *) b < chunk + PERF_CHUNK)
+            return true;
+    }
+    return false;
+}
+
+static void perf_release(perf_block_t *b)
+{
+    size_t class = perf_class(b->payload_size);
+
+    /* The checking tiers also look the block up among the chunks, which
+     * catches a marker forged by a wild write while perf blocks are live.
+     */
+    if (!perf_live ||
+        (tier != HARNESS_PERF && class < PERF_CLASSES && !perf_owns(b))) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p",
+                     b->payload);
+        error_occurred = true;
+        return;
+    }
+
+    /* A second free of the block then fails the header check */
+    b->magic = MAGICFREE;
+    perf_live--;
+    allocated_count--;
+    account_free(b->payload_size, perf_overhead(b->payload_size));
+
+    if (class >= PERF_CLASSES) {
+        free(b);
+        return;
+    }
+    if (tier == HARNESS_PARANOID)
+        memset(b->payload, FILLCHAR, b->payload_size);
+    *(perf_block_t **) b->payload = perf_free_list[class];
+    perf_free_list[class] = b;
+}
+
+static bool guard_setup()
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    guard_pool_size = (2 * GUARD_SLOTS + 1) * page_size;
+    void *pool = mmap(NULL, guard_pool_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        report_event(MSG_WARN, "Cannot map guard pages, sampling disabled");
+        guard_rate = guard_countdown = 0;
+        return false;
+    }
+
+    guard_pool = pool;
+    for (size_t i = 0; i < GUARD_SLOTS; i++)
+        guard_free[i] = i;
+    guard_free_count = GUARD_SLOTS;
+    return true;
+}
+
+/* End of the payload page of a slot, where its trailing guard page starts */
+static inline unsigned char *guard_end(size_t slot)
+{
+    return guard_pool + (2 * slot + 2) * page_size;
+}
+
+/* Place a sampled allocation, which fits in a page, in the guard pool. Return
+ * NULL to have the block allocated normally instead when no slot is ready for
+ * reuse; the sample then stays due, and the next allocation that fits takes
+ * it.
+ */
+static void *guard_alloc(alloc_t alloc_type, size_t size)
+{
+    guard_countdown = 1;
+    if (!guard_free_count)
+        return NULL;
+
+    size_t slot = guard_free[guard_free_head];
+    unsigned char *end = guard_end(slot);
+    if (mprotect(end - page_size, page_size, PROT_READ | PROT_WRITE))
+        return NULL;
+    guard_countdown = rand_next() % (2 * guard_rate - 1) + 1;
+    guard_free_head = (guard_free_head + 1) % GUARD_SLOTS;
+    guard_free_count--;
+
+    /* Any type of this size has an alignment dividing the size, so the block
+     * can end right at the guard page and still be suitably aligned.
+     */
+    void *p = end - size;
+    guard_size[slot] = size;
+    guard_live[slot] = true;
+    guard_live_count++;
+    allocated_count++;
+    account_alloc(size, GUARD_OVERHEAD(size));
+    if (alloc_type == TEST_CALLOC)
+        memset(p, 0, size);
+    else if (tier == HARNESS_PARANOID)
+        memset(p, FILLCHAR, size);
+    return p;
+}
+
+static void guard_release(void *p)
+{
+    /* p - 1 lies in the payload page, even for a zero-sized block */
+    size_t slot = ((unsigned char *) p - 1 - guard_pool) / (2 * page_size);
+    if (slot >= GUARD_SLOTS || !guard_live[slot] ||
+        p != guard_end(slot) - guard_size[slot]) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+
+    guard_live[slot] = false;
+    guard_live_count--;
+    allocated_count--;
+    account_free(guard_size[slot], GUARD_OVERHEAD(guard_size[slot]));
+    mprotect(guard_end(slot) - page_size, page_size, PROT_NONE);
+    guard_free[(guard_free_head + guard_free_count++) % GUARD_SLOTS] = slot;
+}
+
 static void *alloc(alloc_t alloc_type, size_t size)
 {
     if (noallocate_mode) {
@@ -142,6 +499,16 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
+    /* Blocks larger than a page are never sampled, nor counted towards one */
+    if (guard_countdown && size <= page_size && !--guard_countdown) {
+        void *p = guard_alloc(alloc_type, size);
+        if (p)
+            return p;
+    }
+
+    if (tier == HARNESS_PERF)
+        return perf_alloc(alloc_type, size);
+
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
@@ -155,16 +522,15 @@ static void *alloc(alloc_t alloc_type, size_t size)
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    if (tier == HARNESS_PARANOID)
+        memset(p, !alloc_type * FILLCHAR, size);
+    else if (alloc_type == TEST_CALLOC)
+        memset(p, 0, size);
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (!registry_add(new_block)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
 
     return p;
 }
@@ -197,6 +563,17 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (guard_hit(p)) {
+        guard_release(p);
+        return;
+    }
+
+    perf_block_t *pb = (perf_block_t *) ((size_t) p - sizeof(perf_block_t));
+    if (pb->magic == perf_tag(pb)) {
+        perf_release(pb);
+        return;
+    }
+
     block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -208,20 +585,11 @@ void test_free(void *p)
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    if (tier == HARNESS_PARANOID)
+        memset(p, FILLCHAR, b->payload_size);
 
+    registry_remove(b);
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -240,8 +608,51 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void allocation_stats(alloc_stats_t *stats)
+{
+    stats->blocks = allocated_count;
+    stats->bytes = allocated_bytes;
+    stats->overhead = overhead_bytes;
+    stats->peak_bytes = peak_bytes;
+    stats->guarded = guard_live_count;
+}
+
+void allocation_reset_peak()
+{
+    peak_bytes = allocated_bytes;
+}
+
 /* Implementation of functions for testing */
 
+/* Select how much checking is done on each allocation. Blocks allocated
+ * under another tier remain valid and are freed the way they were allocated.
+ */
+void set_harness_tier(harness_tier_t t)
+{
+    tier = t;
+}
+
+/* Place about one in every n allocations which fit in a page against a guard
+ * page, or none when n is 0. Blocks already in the guard pool stay there until
+ * freed.
+ */
+void set_guard_rate(unsigned n)
+{
+    guard_rate = n;
+    guard_countdown = 0;
+    if (n && (guard_pool || guard_setup()))
+        guard_countdown = rand_next() % (2 * n - 1) + 1;
+}
+
+/* Does addr lie in the guard pool? Only reads two variables, so a SIGSEGV
+ * handler may call it.
+ */
+bool guard_hit(const void *addr)
+{
+    const unsigned char *a = addr;
+    return guard_pool && a >= guard_pool && a < guard_pool + guard_pool_size;
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -21,9 +21,49 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Memory held by the blocks allocated through the harness */
+typedef struct {
+    size_t blocks;     /* Live blocks */
+    size_t bytes;      /* Bytes requested by the live blocks */
+    size_t overhead;   /* Bytes the harness adds around the live blocks */
+    size_t peak_bytes; /* Most bytes requested at once since the last reset */
+    size_t guarded;    /* Live blocks placed against a guard page */
+} alloc_stats_t;
+
+void allocation_stats(alloc_stats_t *stats);
+
+/* Restart peak tracking from the bytes live now */
+void allocation_reset_peak();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Checking done on every allocation, from cheapest to most thorough.
+ * HARNESS_PERF only counts blocks, which come from size-class free lists.
+ * HARNESS_CHECK adds header and footer guards and tracks every block.
+ * HARNESS_PARANOID also fills payloads with FILLCHAR on malloc and free.
+ */
+typedef enum {
+    HARNESS_PERF,
+    HARNESS_CHECK,
+    HARNESS_PARANOID,
+    HARNESS_TIERS,
+} harness_tier_t;
+
+/* Select the checking tier for subsequent allocations */
+void set_harness_tier(harness_tier_t tier);
+
+/*
+ * Place about one in every n allocations, whatever the tier, against a
+ * PROT_NONE guard page, so an overrun or a use after free of it faults at
+ * once. Sampling is off when n is 0.
+ */
+void set_guard_rate(unsigned n);
+
+/* Return whether addr lies in the guard page pool. Async-signal-safe */
+bool guard_hit(const void *addr);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -53,7 +54,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,8 +75,42 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+static int sortalgo = Q_SORT_MERGE;
+
+static int threads = 1;
+
+static int unsorted = 0;
+
+/* Names accepted by 'new' for each queue backend */
+static const char *backend_names[Q_BACKENDS] = {
+    [Q_LIST] = "list",
+    [Q_UNROLLED] = "unrolled",
+    [Q_RING] = "ring",
+    [Q_INDEXED] = "indexed",
+};
+
+/* Backend of a queue created by 'new' without an argument */
+static int backend = Q_LIST;
+
+/* Print memory usage after the queue contents */
+static int memstats = 0;
+
+/* Checking done by the harness on each allocation */
+static int harness = HARNESS_PARANOID;
+
+/* Mean number of allocations between two placed against a guard page */
+static int guard = 0;
+
+/* Seed of the workload generator, 0 for a nondeterministic one. The option
+ * holds an int, so the full 64-bit seed given with -s is kept apart.
+ */
+static int seed = 0;
+static uint64_t seed64 = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+/* Random strings generated at a time by 'ih RAND n' and 'it RAND n' */
+#define RAND_BATCH 64
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* For queue_insert and queue_remove */
 typedef enum {
@@ -85,6 +119,7 @@ typedef enum {
 } position_t;
 /* Forward declarations */
 static bool q_show(int vlevel);
+static void mem_report(int vlevel, bool brief);
 
 static bool do_free(int argc, char *argv[])
 {
@@ -101,9 +136,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +148,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -140,11 +171,23 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
         return false;
     }
 
+    int kind = backend;
+    if (argc == 2) {
+        for (kind = 0; kind < Q_BACKENDS; kind++) {
+            if (!strcmp(argv[1], backend_names[kind]))
+                break;
+        }
+        if (kind == Q_BACKENDS) {
+            report(1, "Unknown queue backend '%s'", argv[1]);
+            return false;
+        }
+    }
+
     bool ok = true;
 
     if (exception_setup(true)) {
@@ -152,7 +195,8 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
-        qctx->q = q_new();
+        qctx->monotone = Q_MONO_NONE;
+        qctx->q = q_new_backend(kind);
         qctx->id = chain.size++;
 
         current = qctx;
@@ -166,18 +210,84 @@ static bool do_new(int argc, char *argv[])
 /* TODO: Add a buf_size check of if the buf_size may be less
  * than MIN_RANDSTR_LEN.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+/* Fill n buffers of buf_size bytes each, laid out back to back, with random
+ * strings. The randomness for all of them is drawn in one call.
+ */
+static void fill_rand_strings(char *buf, size_t buf_size, size_t n)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t lens[RAND_BATCH], total = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = 0;
+        while (len < MIN_RANDSTR_LEN)
+            len = rand_next() % buf_size;
+        lens[i] = len;
+        total += len;
+    }
+
+    uint64_t randstr_buf_64[RAND_BATCH * MAX_RANDSTR_LEN];
+    randombytes((uint8_t *) randstr_buf_64, total * sizeof(uint64_t));
+    const uint64_t *rnd = randstr_buf_64;
+    for (size_t i = 0; i < n; i++, buf += buf_size) {
+        for (size_t k = 0; k < lens[i]; k++)
+            buf[k] = charset[*rnd++ % (sizeof(charset) - 1)];
+        buf[lens[i]] = '\0';
+    }
+}
 
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+/* A monotone queue may drop elements on operations which keep the size of any
+ * other queue, so its size is read back from it.
+ */
+static void monotone_sync(void)
+{
+    if (current && current->q && current->monotone)
+        current->size = q_size(current->q);
+}
 
-    buf[len] = '\0';
+/* A monotone queue refuses an insertion at its head which would break its
+ * order, and q_insert_head() then fails without anything being wrong.
+ */
+static bool monotone_refuses(position_t pos, const char *s)
+{
+    if (pos != POS_HEAD || !current->monotone || !current->size)
+        return false;
+
+    int cmp = strcmp(s, q_peek_head(current->q)->value);
+    return current->monotone == Q_MONO_DESCEND ? cmp < 0 : cmp > 0;
+}
+
+/* Check all reps elements a bulk insertion left at the given end of queue */
+static bool check_bulk_insert(position_t pos, const char *inserts, int reps)
+{
+    q_link(current->q);
+    struct list_head *node = current->q;
+    const char *lasts = NULL;
+    for (int r = 0; r < reps; r++) {
+        node = pos == POS_TAIL ? node->prev : node->next;
+        const char *cur_inserts = list_entry(node, element_t, list)->value;
+        if (!cur_inserts) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            return false;
+        }
+        if (cur_inserts == inserts) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            return false;
+        }
+        if (cur_inserts == lasts) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            return false;
+        }
+        if (strcmp(cur_inserts, inserts)) {
+            report(1, "ERROR: Inserted %s where %s was expected", cur_inserts,
+                   inserts);
+            return false;
+        }
+        lasts = cur_inserts;
+    }
+    return true;
 }
 
 /* insertion */
@@ -200,7 +310,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RAND_BATCH][MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -218,7 +328,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
+        inserts = randstr_buf[0];
     }
 
     if (!current || !current->q)
@@ -227,17 +337,32 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     error_check();
 
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+        int r = 0;
+        // Copies of a fixed string go in as one batch. Should the batch fail,
+        // they are inserted one at a time so that each failure is reported.
+        if (!need_rand && reps > 1 &&
+            q_insert_bulk(current->q, inserts, reps, pos == POS_TAIL)) {
+            current->size += reps;
+            monotone_sync();
+            ok = (current->monotone || check_bulk_insert(pos, inserts, reps)) &&
+                 !error_check();
+            r = reps;
+        }
+        for (; ok && r < reps; r++) {
+            if (need_rand) {
+                if (r % RAND_BATCH == 0) {
+                    int batch = reps - r < RAND_BATCH ? reps - r : RAND_BATCH;
+                    fill_rand_strings(randstr_buf[0], MAX_RANDSTR_LEN, batch);
+                }
+                inserts = randstr_buf[r % RAND_BATCH];
+            }
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
+                monotone_sync();
+                element_t *entry = pos == POS_TAIL ? q_peek_tail(current->q)
+                                                   : q_peek_head(current->q);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
@@ -248,7 +373,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (r == 1 && lasts == cur_inserts &&
+                           !current->monotone) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -256,6 +382,9 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                     break;
                 }
                 lasts = cur_inserts;
+            } else if (monotone_refuses(pos, inserts)) {
+                report(3, "Insertion of %s refused to keep the order",
+                       inserts);
             } else {
                 fail_count++;
                 if (fail_count < fail_limit)
@@ -288,6 +417,56 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Remove n elements in one call, comparing each to str unless it is RAND */
+static bool queue_drain(position_t pos, char *str, char *count)
+{
+    int reps;
+    if (!get_int(count, &reps) || reps < 1) {
+        report(1, "Invalid number of removals '%s'", count);
+        return false;
+    }
+    bool check = strcmp(str, "RAND");
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    LIST_HEAD(removed);
+    int cnt = 0;
+    if (current && exception_setup(true))
+        cnt = q_remove_bulk(current->q, &removed, reps, pos == POS_TAIL);
+    exception_cancel();
+
+    bool ok = true;
+    element_t *item, *tmp;
+    list_for_each_entry_safe (item, tmp, &removed, list) {
+        if (ok && check && strncmp(item->value, str, string_length)) {
+            report(1, "ERROR: Removed value %s != expected value %s",
+                   item->value, str);
+            ok = false;
+        }
+        q_release_element(item);
+    }
+    if (current)
+        current->size -= cnt;
+    report(2, "Removed %d elements from queue", cnt);
+
+    if (cnt < reps) {
+        fail_count++;
+        if (!check && fail_count < fail_limit) {
+            report(2, "Removal from queue failed");
+        } else {
+            report(1, "ERROR: Removal from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -312,10 +491,12 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc > 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
+    if (argc == 3)
+        return queue_drain(pos, argv[1], argv[2]);
 
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
@@ -417,6 +598,43 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+static int cmp_value(const void *a, const void *b)
+{
+    return strcmp((*(element_t *const *) a)->value,
+                  (*(element_t *const *) b)->value);
+}
+
+/* Free the string of every element in l whose string occurs more than once,
+ * leaving its value NULL. Return false if no scratch space is available.
+ */
+static bool mark_duplicates(struct list_head *l, size_t n)
+{
+    element_t **items = malloc(n * sizeof(element_t *));
+    if (!items)
+        return false;
+
+    element_t *item;
+    size_t i = 0;
+    list_for_each_entry (item, l, list)
+        items[i++] = item;
+    qsort(items, n, sizeof(element_t *), cmp_value);
+
+    for (i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && !strcmp(items[i]->value, items[j]->value))
+            j++;
+        if (j - i > 1) {
+            for (size_t k = i; k < j; k++) {
+                free(items[k]->value);
+                items[k]->value = NULL;
+            }
+        }
+        i = j;
+    }
+    free(items);
+    return true;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -431,8 +649,10 @@ static bool do_dedup(int argc, char *argv[])
 
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    size_t copied = 0;
 
     // Copy current->q to l_copy
+    q_link(current->q);
     if (current->q && !list_empty(current->q)) {
         list_for_each_entry (item, current->q, list) {
             size_t slen;
@@ -448,9 +668,11 @@ static bool do_dedup(int argc, char *argv[])
             }
             memcpy(tmp->value, item->value, slen);
             list_add_tail(&tmp->list, &l_copy);
+            copied++;
         }
         // Return false if the loop does not leave properly
-        if (&item->list != current->q) {
+        if (&item->list != current->q ||
+            (unsorted && !mark_duplicates(&l_copy, copied))) {
             list_for_each_entry_safe (item, tmp, &l_copy, list) {
                 free(item->value);
                 free(item);
@@ -464,7 +686,8 @@ static bool do_dedup(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(current->q);
+        ok = unsorted ? q_delete_dup_unsorted(current->q)
+                      : q_delete_dup(current->q);
     exception_cancel();
 
     if (!ok) {
@@ -472,20 +695,31 @@ static bool do_dedup(int argc, char *argv[])
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        if (unsorted && current->size)
+            report(1, "ERROR: Could not delete duplicates in queue");
+        else
+            report(1, "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
+    q_link(current->q);
     struct list_head *l_tmp = current->q->next;
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
+        bool is_next_dup = false, is_dup;
+        if (unsorted) {
+            // Duplicates have been marked by mark_duplicates()
+            is_dup = !item->value;
+        } else {
+            is_next_dup =
+                item->list.next != &l_copy &&
+                strcmp(list_entry(item->list.next, element_t, list)->value,
+                       item->value) == 0;
+            is_dup = is_this_dup || is_next_dup;
+        }
         // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
-        if (is_this_dup || is_next_dup) {
+        if (is_dup) {
             // Update list size
             current->size--;
         } else if (l_tmp != current->q &&
@@ -527,6 +761,7 @@ static bool do_reverse(int argc, char *argv[])
     if (current && exception_setup(true))
         q_reverse(current->q);
     exception_cancel();
+    monotone_sync();
 
     set_noallocate_mode(false);
     q_show(3);
@@ -576,6 +811,44 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Time a sort of a copy of queue on one thread and on the configured number of
+ * threads. The two copies are built side by side, so that their nodes are laid
+ * out alike and the comparison is not skewed by the layout of the queue, whose
+ * nodes may be scattered by earlier operations. Return false if the copies
+ * could not be made.
+ */
+static bool time_sort_copies(struct list_head *head, double *times)
+{
+    int kind = list_entry(head, queue_t, head)->backend;
+    struct list_head *copy[2] = {q_new_backend(kind), q_new_backend(kind)};
+    bool ok = copy[0] && copy[1];
+
+    element_t *entry;
+    q_link(head);
+    list_for_each_entry (entry, head, list) {
+        if (!ok || !q_insert_tail(copy[0], entry->value) ||
+            !q_insert_tail(copy[1], entry->value)) {
+            ok = false;
+            break;
+        }
+    }
+
+    for (int i = 0; ok && i < 2; i++) {
+        q_set_sort_threads(i ? threads : 1);
+        set_noallocate_mode(true);
+        init_time(&times[i]);
+        if (exception_setup(true))
+            q_sort(copy[i], descend);
+        exception_cancel();
+        times[i] = delta_time(&times[i]);
+        set_noallocate_mode(false);
+    }
+    q_set_sort_threads(threads);
+    q_free(copy[0]);
+    q_free(copy[1]);
+    return ok;
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -594,6 +867,11 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    double copy_times[2];
+    bool compared = false;
+    if (threads > 1 && cnt >= 2)
+        compared = time_sort_copies(current->q, copy_times);
+
     set_noallocate_mode(true);
 
 /* If the number of elements is too large, it may take a long time to check the
@@ -604,6 +882,7 @@ bool do_sort(int argc, char *argv[])
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
         element_t *entry;
+        q_link(current->q);
         list_for_each_entry (entry, current->q, list)
             nodes[no++] = &entry->list;
     } else if (current && current->size > MAX_NODES)
@@ -612,13 +891,32 @@ bool do_sort(int argc, char *argv[])
                "number of elements %d is too large, exceeds the limit %d.",
                current->size, MAX_NODES);
 
+    double sort_time;
+    init_time(&sort_time);
     if (current && exception_setup(true))
         q_sort(current->q, descend);
     exception_cancel();
+    sort_time = delta_time(&sort_time);
+    monotone_sync();
     set_noallocate_mode(false);
 
+    if (threads > 1 && current) {
+        report(2, "Sorted %d elements in %.3f s with up to %d threads", cnt,
+               sort_time, threads);
+        if (!compared)
+            report(2, "No serial baseline, the queue could not be copied");
+        else if (copy_times[1] > 0)
+            report(2,
+                   "Copies sorted in %.3f s on one thread and %.3f s with up "
+                   "to %d threads, a speedup of %.2fx",
+                   copy_times[0], copy_times[1], threads,
+                   copy_times[0] / copy_times[1]);
+    }
+
     bool ok = true;
     if (current && current->size) {
+        cnt = current->size;
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending/descending order */
@@ -669,26 +967,167 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
+    int reps = 1;
+    if (argc == 2) {
+        if (!get_int(argv[1], &reps) || reps < 1) {
+            report(1, "Invalid number of deletions '%s'", argv[1]);
+            return false;
+        }
+    }
+
     if (!current || !current->q) {
         report(3, "Warning: Try to access null queue");
         return false;
     }
     error_check();
 
+    if (!current->size)
+        report(3, "Warning: Try to delete middle node to empty queue");
+
     bool ok = true;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            ok = q_delete_mid(current->q);
+            if (ok && !--current->size)
+                break;
+        }
+    }
+    exception_cancel();
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Parse the position argument of 'at', 'del' and 'ins' */
+static bool get_position(char *arg, int *pos)
+{
+    if (!get_int(arg, pos)) {
+        report(1, "Invalid position '%s'", arg);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    return true;
+}
+
+static bool do_at(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s takes 1 or 2 arguments", argv[0]);
+        return false;
+    }
+
+    int pos;
+    if (!get_position(argv[1], &pos))
+        return false;
+    error_check();
+
+    element_t *e = NULL;
     if (exception_setup(true))
-        ok = q_delete_mid(current->q);
+        e = q_at(current->q, pos);
     exception_cancel();
 
-    if (!current->size)
-        report(3, "Warning: Try to delete middle node to empty queue");
-    else
-        --current->size;
+    bool ok = true;
+    if (pos < 0 || pos >= current->size) {
+        if (e) {
+            report(1,
+                   "ERROR: Returned an element for position %d, out of range",
+                   pos);
+            ok = false;
+        } else {
+            report(3, "Warning: Position %d is out of range", pos);
+        }
+    } else if (!e) {
+        report(1, "ERROR: Failed to get the element at position %d", pos);
+        ok = false;
+    } else {
+        report(1, "l[%d] = %s", pos, e->value);
+        if (argc == 3 && strcmp(e->value, argv[2])) {
+            report(1, "ERROR: Value %s at position %d != expected value %s",
+                   e->value, pos, argv[2]);
+            ok = false;
+        }
+    }
+    return ok && !error_check();
+}
+
+static bool do_del(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    int pos;
+    if (!get_position(argv[1], &pos))
+        return false;
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_delete_at(current->q, pos);
+    exception_cancel();
+
+    if (pos < 0 || pos >= current->size) {
+        if (ok) {
+            report(1, "ERROR: Deleted at position %d, out of range", pos);
+            ok = false;
+        } else {
+            report(3, "Warning: Position %d is out of range", pos);
+            ok = true;
+        }
+    } else if (ok) {
+        current->size--;
+    }
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_ins(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s takes 2 arguments", argv[0]);
+        return false;
+    }
+
+    int pos;
+    if (!get_position(argv[1], &pos))
+        return false;
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_insert_at(current->q, pos, argv[2]);
+    exception_cancel();
+
+    if (pos < 0 || pos > current->size) {
+        if (ok) {
+            report(1, "ERROR: Inserted at position %d, out of range", pos);
+            ok = false;
+        } else {
+            report(3, "Warning: Position %d is out of range", pos);
+            ok = true;
+        }
+    } else if (ok) {
+        current->size++;
+        monotone_sync();
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Insertion of %s failed", argv[2]);
+            ok = true;
+        } else {
+            report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                   argv[2], fail_count);
+        }
+    }
     q_show(3);
     return ok && !error_check();
 }
@@ -710,6 +1149,7 @@ static bool do_swap(int argc, char *argv[])
     if (exception_setup(true))
         q_swap(current->q);
     exception_cancel();
+    monotone_sync();
 
     set_noallocate_mode(false);
 
@@ -718,6 +1158,52 @@ static bool do_swap(int argc, char *argv[])
 }
 
 
+/* Names accepted by 'monotone' for each Q_MONO_* order */
+static const char *monotone_names[] = {
+    [Q_MONO_NONE] = "off",
+    [Q_MONO_ASCEND] = "ascend",
+    [Q_MONO_DESCEND] = "descend",
+};
+
+static bool do_monotone(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    int order;
+    for (order = Q_MONO_NONE; order <= Q_MONO_DESCEND; order++) {
+        if (!strcmp(argv[1], monotone_names[order]))
+            break;
+    }
+    if (order > Q_MONO_DESCEND) {
+        report(1, "Unknown order '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    int size = -1;
+    if (exception_setup(true))
+        size = q_set_monotone(current->q, order);
+    exception_cancel();
+
+    bool ok = size >= 0;
+    if (ok) {
+        current->size = size;
+        current->monotone = order;
+    } else {
+        report(1, "ERROR: Could not make the queue keep its order");
+    }
+    q_show(3);
+    return ok && !error_check();
+}
+
 static bool do_ascend(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -747,6 +1233,7 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
@@ -794,6 +1281,7 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
@@ -836,6 +1324,7 @@ static bool do_reverseK(int argc, char *argv[])
     if (exception_setup(true))
         q_reverseK(current->q, k);
     exception_cancel();
+    monotone_sync();
 
     set_noallocate_mode(false);
     q_show(3);
@@ -855,14 +1344,41 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
-    int len = 0;
+    // Let the first queue take in every element without allocating
+    int len = 0, total = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain)
+        total += q_size(ctx->q);
+    if (!q_reserve(list_first_entry(&chain.head, queue_contex_t, chain)->q,
+                   total)) {
+        bool ok = false;
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Reserving room to merge %d elements failed", total);
+            ok = true;
+        } else {
+            report(1,
+                   "ERROR: Reserving room to merge %d elements failed (%d "
+                   "failures total)",
+                   total, fail_count);
+        }
+        q_show(3);
+        return ok && !error_check();
+    }
+
     set_noallocate_mode(true);
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (len < 0) {
+        report(1, "ERROR: Merge refused with room reserved for %d elements",
+               total);
+        return false;
+    }
+
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -881,6 +1397,7 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --len; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -946,9 +1463,12 @@ static bool q_show(int vlevel)
     int cnt = 0;
     if (!current || !current->q) {
         report(vlevel, "l = NULL");
+        if (memstats)
+            mem_report(vlevel, true);
         return true;
     }
 
+    q_link(current->q);
     if (!is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
@@ -994,6 +1514,8 @@ static bool q_show(int vlevel)
         ok = false;
     }
 
+    if (memstats)
+        mem_report(vlevel, true);
     return ok;
 }
 
@@ -1010,6 +1532,61 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Report the memory held by the queues, either as one line or in full */
+static void mem_report(int vlevel, bool brief)
+{
+    alloc_stats_t st;
+    allocation_stats(&st);
+
+    if (brief) {
+        report(vlevel, "mem: %zu blocks, %zu bytes (+%zu), peak %zu bytes",
+               st.blocks, st.bytes, st.overhead, st.peak_bytes);
+        return;
+    }
+
+    report(vlevel, "Live:     %zu blocks, %zu bytes", st.blocks, st.bytes);
+    report(vlevel, "Peak:     %zu bytes since last reset", st.peak_bytes);
+    report(vlevel, "Overhead: %zu bytes (%.1f%% of live bytes)", st.overhead,
+           st.bytes ? 100.0 * st.overhead / st.bytes : 0.0);
+    if (guard || st.guarded)
+        report(vlevel, "Guarded:  %zu blocks", st.guarded);
+
+    /* What no queue accounts for: slabs left behind by freed queues while
+     * elements merged elsewhere still live in them
+     */
+    size_t owned = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        size_t bytes = q_footprint(ctx->q);
+        owned += bytes;
+        report(vlevel, "Queue %d:  %d elements, %zu bytes, %.1f per element",
+               ctx->id, ctx->size, bytes,
+               ctx->size ? (double) bytes / ctx->size : 0.0);
+    }
+    report(vlevel, "Other:    %zu bytes", st.bytes - owned);
+
+    size_t cur, peak, last_peak;
+    mem_usage(&cur, &peak, &last_peak);
+    report(vlevel, "Console:  %zu bytes, peak %zu, %zu since last reset",
+           cur, peak, last_peak);
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        allocation_reset_peak();
+        reset_peak_bytes();
+        return true;
+    }
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    mem_report(1, false);
+    return true;
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1056,9 +1633,90 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static void set_sortalgo(int oldval)
+{
+    if (!q_set_sort_algo(sortalgo)) {
+        report(1, "Unknown sort algorithm %d", sortalgo);
+        sortalgo = oldval;
+    }
+}
+
+static void set_threads(int oldval)
+{
+    if (!q_set_sort_threads(threads)) {
+        report(1, "Number of threads must be between 1 and %d",
+               Q_MAX_SORT_THREADS);
+        threads = oldval;
+    }
+}
+
+static void set_backend(int oldval)
+{
+    if (backend < 0 || backend >= Q_BACKENDS) {
+        report(1, "Unknown queue backend %d", backend);
+        backend = oldval;
+    }
+}
+
+static void set_harness(int oldval)
+{
+    if (harness < 0 || harness >= HARNESS_TIERS) {
+        report(1, "Unknown harness tier %d", harness);
+        harness = oldval;
+    }
+    set_harness_tier(harness);
+}
+
+static void set_guard(int oldval)
+{
+    if (guard < 0) {
+        report(1, "Guard sampling rate must not be negative");
+        guard = oldval;
+    }
+    set_guard_rate(guard);
+}
+
+uintptr_t os_random(uintptr_t seed)
+{
+    /* ASLR makes the address random */
+    uintptr_t x = (uintptr_t) &os_random ^ seed;
+#if defined(__APPLE__)
+    x ^= (uintptr_t) mach_absolute_time();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    x ^= (uintptr_t) time.tv_sec;
+    x ^= (uintptr_t) time.tv_nsec;
+#endif
+    /* Do a few randomization steps */
+    uintptr_t max = ((x ^ (x >> 17)) & 0x0F) + 1;
+    for (uintptr_t i = 0; i < max; i++)
+        x = random_shuffle(x);
+    assert(x);
+    return x;
+}
+
+/* Seed the workload generator. A nonzero seed makes the run reproducible,
+ * while 0 draws the seed from the environment as before.
+ */
+static void apply_seed(void)
+{
+    if (seed64)
+        rand_seed(seed64, true);
+    else
+        rand_seed(os_random(getpid() ^ getppid()), false);
+}
+
+static void set_seed(int oldval)
+{
+    (void) oldval;
+    seed64 = (uint32_t) seed;
+    apply_seed();
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "Create new queue", "");
+    ADD_COMMAND(new, "Create new queue", "[list|unrolled|ring|indexed]");
     ADD_COMMAND(free, "Delete queue", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
@@ -1072,17 +1730,32 @@ static void console_init()
                 "str [n]");
     ADD_COMMAND(
         rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
+        "Remove from head of queue n times. Optionally compare to expected "
+        "value str, unless str equals RAND. (default: n == 1)",
+        "[str [n]]");
     ADD_COMMAND(
         rt,
-        "Remove from tail of queue. Optionally compare to expected value str",
-        "[str]");
+        "Remove from tail of queue n times. Optionally compare to expected "
+        "value str, unless str equals RAND. (default: n == 1)",
+        "[str [n]]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
-    ADD_COMMAND(dm, "Delete middle node in queue", "");
+    ADD_COMMAND(mem, "Show memory held by queues, or restart peak tracking",
+                "[reset]");
+    ADD_COMMAND(dm, "Delete middle node in queue n times (default: n == 1)",
+                "[n]");
+    ADD_COMMAND(monotone,
+                "Make queue keep the order left by ascend or descend on every "
+                "insertion",
+                "[off|ascend|descend]");
+    ADD_COMMAND(at,
+                "Show the element at position i of queue. Optionally compare "
+                "to expected value str",
+                "i [str]");
+    ADD_COMMAND(del, "Delete the element at position i of queue", "i");
+    ADD_COMMAND(ins, "Insert string str at position i of queue", "i str");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
@@ -1104,11 +1777,39 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sortalgo", &sortalgo,
+              "Sort algorithm (0: merge sort, 1: adaptive merge sort, "
+              "2: radix sort)",
+              set_sortalgo);
+    add_param("threads", &threads, "Number of threads sorting a large queue",
+              set_threads);
+    add_param("backend", &backend,
+              "Backend of a new queue (0: list, 1: unrolled, 2: ring, "
+              "3: indexed)",
+              set_backend);
+    add_param("unsorted", &unsorted,
+              "Dedup removes duplicates anywhere, not only adjacent ones",
+              NULL);
+    add_param("memstats", &memstats,
+              "Show memory usage after every queue display", NULL);
+    add_param("harness", &harness,
+              "Allocation checks (0: perf, 1: check, 2: paranoid)",
+              set_harness);
+    add_param("guard", &guard,
+              "Place one in N allocations against a guard page (0: off)",
+              set_guard);
+    add_param("seed", &seed, "Seed for reproducible random input (0: none)",
+              set_seed);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+static void sigsegv_handler(int sig, siginfo_t *info, void *ucontext)
 {
+    /* The access hit a guard page, before anything was corrupted */
+    if (guard_hit(info->si_addr))
+        trigger_exception(
+            "Out-of-bounds access or use after free of a sampled block");
+
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
@@ -1129,15 +1830,15 @@ static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    struct sigaction sa = {.sa_sigaction = sigsegv_handler,
+                           .sa_flags = SA_SIGINFO};
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1151,7 +1852,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1165,11 +1865,12 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-s SEED]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-s SEED    Seed random input for a reproducible run\n");
     exit(0);
 }
 
@@ -1205,26 +1906,6 @@ static bool sanity_check()
     return true;
 }
 
-uintptr_t os_random(uintptr_t seed)
-{
-    /* ASLR makes the address random */
-    uintptr_t x = (uintptr_t) &os_random ^ seed;
-#if defined(__APPLE__)
-    x ^= (uintptr_t) mach_absolute_time();
-#else
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC, &time);
-    x ^= (uintptr_t) time.tv_sec;
-    x ^= (uintptr_t) time.tv_nsec;
-#endif
-    /* Do a few randomization steps */
-    uintptr_t max = ((x ^ (x >> 17)) & 0x0F) + 1;
-    for (uintptr_t i = 0; i < max; i++)
-        x = random_shuffle(x);
-    assert(x);
-    return x;
-}
-
 #define BUFSIZE 256
 int main(int argc, char *argv[])
 {
@@ -1240,7 +1921,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:s:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1265,6 +1946,18 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 's': {
+            char *endptr;
+            errno = 0;
+            seed64 = strtoull(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg || *endptr != '\0' ||
+                strchr(optarg, '-')) {
+                fprintf(stderr, "Invalid seed\n");
+                exit(EXIT_FAILURE);
+            }
+            seed = seed64 <= INT_MAX ? (int) seed64 : 0;
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1272,10 +1965,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* A better seed can be obtained by combining getpid() and its parent ID
-     * with the Unix time.
-     */
-    srand(os_random(getpid() ^ getppid()));
+    apply_seed();
 
     q_init();
     init_cmd();
@@ -1,9 +1,12 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "queue.h"
+#include "random.h"
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -15,18 +18,1013 @@
  * Self-defined functions for q_sort
  */
 struct list_head *mergesort(struct list_head *, bool);
+struct list_head *timsort(struct list_head *, size_t, bool);
+struct list_head *radixsort(struct list_head *, size_t, bool);
 struct list_head *merge2SortedLists(struct list_head *,
                                     struct list_head *,
                                     bool);
+
+/* Engine used by q_sort(), one of Q_SORT_* */
+static int sort_algo = Q_SORT_MERGE;
+
+/* Threads q_sort() may use on a queue of at least PARALLEL_SORT_MIN nodes */
+static int sort_threads = 1;
+
+/* Get the queue header owning the list head handed out by q_new() */
+static inline queue_t *q_header(struct list_head *head)
+{
+    return list_entry(head, queue_t, head);
+}
+
+/* Pack the first bytes of s into an integer, most significant byte first,
+ * padding with zeros after the terminator. Comparing two such keys gives the
+ * same order as strcmp() on the first Q_PREFIX_LEN bytes.
+ */
+static inline uint64_t q_prefix(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < Q_PREFIX_LEN && s[i]; i++)
+        key |= (uint64_t) (unsigned char) s[i] << (8 * (Q_PREFIX_LEN - 1 - i));
+    return key;
+}
+
+/* Compare the strings of two elements in the requested order. A positive
+ * result means a has to be placed after b.
+ *
+ * The cached prefixes decide most comparisons. On a tie, a zero low byte
+ * means both strings ended inside the prefix and are equal; otherwise both
+ * are longer than the prefix and strcmp() resumes after it.
+ */
+static inline int q_cmp(const struct list_head *a,
+                        const struct list_head *b,
+                        bool descend)
+{
+    const element_t *ea = list_entry(a, element_t, list);
+    const element_t *eb = list_entry(b, element_t, list);
+    int cmp;
+
+    if (ea->prefix != eb->prefix)
+        cmp = ea->prefix < eb->prefix ? -1 : 1;
+    else if (!(ea->prefix & 0xff))
+        cmp = 0;
+    else
+        cmp = strcmp(ea->value + Q_PREFIX_LEN, eb->value + Q_PREFIX_LEN);
+    return descend ? -cmp : cmp;
+}
+
+/*
+ * Element allocator
+ *
+ * Every element occupies one fixed-size slot. Slots are carved from slabs by
+ * bumping an offset, and released slots are kept on the owning queue's free
+ * list, so a slot is recycled before the slab grows. The first slab of a queue
+ * holds SLAB_MIN slots and every further one twice as many as the last, up to
+ * SLAB_MAX, so a short queue stays small while a long one needs few slabs.
+ * Slabs are allocated through the harness like any other block. Because
+ * q_merge() moves elements between queues, a slab may outlive its queue:
+ * q_free() then orphans it, and the slab is freed as soon as its last live
+ * slot is released.
+ */
+
+/* Slots in the first and in the largest slab of a queue */
+#define SLAB_MIN 16
+#define SLAB_MAX 1024
+
+typedef struct q_slot {
+    struct q_slab *slab;
+    union {
+        element_t elem;
+        struct q_slot *next_free; /* Link in the owner's free list */
+    };
+} q_slot_t;
+
+typedef struct q_slab {
+    struct q_slab *next; /* Next slab of the same queue */
+    queue_t *owner;      /* NULL once the owning queue has been freed */
+    size_t live;         /* Slots handed out and not released yet */
+    size_t used;         /* Slots carved from the slab so far */
+    size_t cap;          /* Slots the slab holds */
+    q_slot_t slots[];
+} q_slab_t;
+
+static q_slot_t *q_slot_alloc(queue_t *q)
+{
+    q_slot_t *slot = q->free_slots;
+    if (slot) {
+        q->free_slots = slot->next_free;
+    } else {
+        q_slab_t *slab = q->slabs;
+        if (!slab || slab->used == slab->cap) {
+            size_t cap = slab ? 2 * slab->cap : SLAB_MIN;
+            if (cap > SLAB_MAX)
+                cap = SLAB_MAX;
+            slab = malloc(sizeof(q_slab_t) + cap * sizeof(q_slot_t));
+            if (!slab)
+                return NULL;
+            slab->owner = q;
+            slab->live = 0;
+            slab->used = 0;
+            slab->cap = cap;
+            slab->next = q->slabs;
+            q->slabs = slab;
+        }
+        slot = &slab->slots[slab->used++];
+        slot->slab = slab;
+    }
+    slot->slab->live++;
+    return slot;
+}
+
+void q_release_element(element_t *e)
+{
+    if (e->value != e->inline_value)
+        free(e->value);
+
+    q_slot_t *slot = container_of(e, q_slot_t, elem);
+    q_slab_t *slab = slot->slab;
+    slab->live--;
+    if (slab->owner) {
+        slot->next_free = slab->owner->free_slots;
+        slab->owner->free_slots = slot;
+    } else if (!slab->live) {
+        free(slab);
+    }
+}
+
+/* Release the elements a monotone queue has dropped while it could not free */
+static void q_release_dropped(queue_t *q)
+{
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &q->dropped, list)
+        q_release_element(e);
+    INIT_LIST_HEAD(&q->dropped);
+}
+
+/*
+ * Unrolled backend
+ *
+ * A Q_UNROLLED queue stores pointers to its elements in chunks of CHUNK_SLOTS,
+ * so walking it reads handles sequentially instead of chasing one node per
+ * element. The handles of a chunk occupy items[start, end), which lets both
+ * ends of the queue grow and shrink in place.
+ *
+ * Insertion, removal, deletion by position, reversal in groups and the scans
+ * which drop elements work on the handles directly and leave the list nodes of
+ * the elements alone. A scan compacts the chunks in place: the handles it
+ * keeps are written back behind the ones it reads. Sorting, merging and
+ * insertion by position are written once against the list: q_unpack() links
+ * the elements on the queue head, the list code runs, and q_pack() stores the
+ * result back into chunks, leaving the links valid until the queue is next
+ * modified. Packing does not allocate as long as the queue has not grown:
+ * chunks emptied by unpacking are kept as spares, and the operations which
+ * leave a queue longer than before reserve the chunks they need up front.
+ */
+
+/* Element handles held by one chunk */
+#define CHUNK_SLOTS 64
+
+typedef struct q_chunk {
+    struct list_head link; /* Node in the chunks or spare list of the queue */
+    int start, end;        /* Handles in use are items[start, end) */
+    element_t *items[CHUNK_SLOTS];
+} q_chunk_t;
+
+static inline bool q_unrolled(const queue_t *q)
+{
+    return q->backend == Q_UNROLLED;
+}
+
+/* Make sure at least n chunks are kept as spares */
+static bool chunk_spare(queue_t *q, size_t n)
+{
+    struct list_head *node;
+    size_t have = 0;
+
+    list_for_each (node, &q->spare)
+        have++;
+    for (; have < n; have++) {
+        q_chunk_t *c = malloc(sizeof(q_chunk_t));
+        if (!c)
+            return false;
+        list_add(&c->link, &q->spare);
+    }
+    return true;
+}
+
+/* Take a spare chunk, or allocate a new one */
+static q_chunk_t *chunk_get(queue_t *q)
+{
+    if (list_empty(&q->spare))
+        return malloc(sizeof(q_chunk_t));
+
+    q_chunk_t *c = list_first_entry(&q->spare, q_chunk_t, link);
+    list_del(&c->link);
+    return c;
+}
+
+static bool chunk_push(queue_t *q, element_t *e, bool tail)
+{
+    q_chunk_t *c = NULL;
+
+    if (!list_empty(&q->chunks))
+        c = tail ? list_last_entry(&q->chunks, q_chunk_t, link)
+                 : list_first_entry(&q->chunks, q_chunk_t, link);
+    if (!c || (tail ? c->end == CHUNK_SLOTS : !c->start)) {
+        c = chunk_get(q);
+        if (!c)
+            return false;
+        c->start = c->end = tail ? 0 : CHUNK_SLOTS;
+        if (tail)
+            list_add_tail(&c->link, &q->chunks);
+        else
+            list_add(&c->link, &q->chunks);
+    }
+
+    if (tail)
+        c->items[c->end++] = e;
+    else
+        c->items[--c->start] = e;
+    return true;
+}
+
+static element_t *chunk_peek(queue_t *q, bool tail)
+{
+    q_chunk_t *c = tail ? list_last_entry(&q->chunks, q_chunk_t, link)
+                        : list_first_entry(&q->chunks, q_chunk_t, link);
+    return tail ? c->items[c->end - 1] : c->items[c->start];
+}
+
+/* Unlink a chunk which has been emptied */
+static void chunk_drop(queue_t *q, q_chunk_t *c)
+{
+    // One spare is kept so a queue hovering around a chunk boundary does
+    // not allocate and free a chunk on every operation.
+    list_del(&c->link);
+    if (list_empty(&q->spare))
+        list_add(&c->link, &q->spare);
+    else
+        free(c);
+}
+
+static element_t *chunk_pop(queue_t *q, bool tail)
+{
+    q_chunk_t *c = tail ? list_last_entry(&q->chunks, q_chunk_t, link)
+                        : list_first_entry(&q->chunks, q_chunk_t, link);
+    element_t *e = tail ? c->items[--c->end] : c->items[c->start++];
+
+    if (c->start == c->end)
+        chunk_drop(q, c);
+    return e;
+}
+
+/* Position of a handle: items[i] of chunk c */
+struct chunk_pos {
+    q_chunk_t *c;
+    int i;
+};
+
+/* Step to the next handle. Stepping past the last one leaves i at the end of
+ * the last chunk, and stepping back before the first one leaves i below the
+ * start of the first chunk.
+ */
+static inline void chunk_next(queue_t *q, struct chunk_pos *p)
+{
+    if (++p->i == p->c->end && p->c->link.next != &q->chunks) {
+        p->c = list_entry(p->c->link.next, q_chunk_t, link);
+        p->i = p->c->start;
+    }
+}
+
+static inline void chunk_prev(queue_t *q, struct chunk_pos *p)
+{
+    if (p->i-- == p->c->start && p->c->link.prev != &q->chunks) {
+        p->c = list_entry(p->c->link.prev, q_chunk_t, link);
+        p->i = p->c->end - 1;
+    }
+}
+
+/* Find the handle at position pos, skipping whole chunks from the nearer end */
+static struct chunk_pos chunk_seek(queue_t *q, int pos)
+{
+    struct chunk_pos p;
+
+    if (pos < q->size - 1 - pos) {
+        list_for_each_entry (p.c, &q->chunks, link) {
+            if (pos < p.c->end - p.c->start)
+                break;
+            pos -= p.c->end - p.c->start;
+        }
+        p.i = p.c->start + pos;
+        return p;
+    }
+
+    pos = q->size - 1 - pos;
+    for (p.c = list_last_entry(&q->chunks, q_chunk_t, link);
+         pos >= p.c->end - p.c->start;
+         p.c = list_entry(p.c->link.prev, q_chunk_t, link))
+        pos -= p.c->end - p.c->start;
+    p.i = p.c->end - 1 - pos;
+    return p;
+}
+
+/* Take out the handle at position pos, shifting the shorter side of its chunk
+ * over it
+ */
+static element_t *chunk_delete(queue_t *q, int pos)
+{
+    struct chunk_pos p = chunk_seek(q, pos);
+    q_chunk_t *c = p.c;
+    element_t *e = c->items[p.i];
+
+    if (p.i - c->start < c->end - 1 - p.i) {
+        memmove(&c->items[c->start + 1], &c->items[c->start],
+                (p.i - c->start) * sizeof(c->items[0]));
+        c->start++;
+    } else {
+        memmove(&c->items[p.i], &c->items[p.i + 1],
+                (c->end - 1 - p.i) * sizeof(c->items[0]));
+        c->end--;
+    }
+    if (c->start == c->end)
+        chunk_drop(q, c);
+    return e;
+}
+
+/* Reverse groups of k handles, the first one starting at position from */
+static void chunk_reverse_groups(queue_t *q, int from, int k, int groups)
+{
+    struct chunk_pos lo = chunk_seek(q, from);
+
+    for (; groups; groups--) {
+        struct chunk_pos hi = lo, next;
+        for (int i = 1; i < k; i++)
+            chunk_next(q, &hi);
+        next = hi;
+        chunk_next(q, &next);
+        for (int i = 0; i < k / 2; i++) {
+            element_t *tmp = lo.c->items[lo.i];
+            lo.c->items[lo.i] = hi.c->items[hi.i];
+            hi.c->items[hi.i] = tmp;
+            chunk_next(q, &lo);
+            chunk_prev(q, &hi);
+        }
+        lo = next;
+    }
+}
+
+/* In-place compaction of a non-empty unrolled queue. Handles are read one at a
+ * time towards either end, and those kept are written back from where reading
+ * began, so the writer never overtakes the reader. Chunks left empty become
+ * spares.
+ */
+struct chunk_scan {
+    queue_t *q;
+    struct chunk_pos r, w;
+    int left; /* Handles not read yet */
+    bool back;
+};
+
+static void chunk_scan_init(struct chunk_scan *s, queue_t *q, bool back)
+{
+    s->q = q;
+    s->r.c = back ? list_last_entry(&q->chunks, q_chunk_t, link)
+                  : list_first_entry(&q->chunks, q_chunk_t, link);
+    s->r.i = back ? s->r.c->end - 1 : s->r.c->start;
+    s->w = s->r;
+    s->left = q->size;
+    s->back = back;
+}
+
+static element_t *chunk_scan_next(struct chunk_scan *s)
+{
+    if (!s->left)
+        return NULL;
+    s->left--;
+
+    element_t *e = s->r.c->items[s->r.i];
+    if (s->back)
+        chunk_prev(s->q, &s->r);
+    else
+        chunk_next(s->q, &s->r);
+    return e;
+}
+
+static void chunk_scan_keep(struct chunk_scan *s, element_t *e)
+{
+    s->w.c->items[s->w.i] = e;
+    if (s->back)
+        chunk_prev(s->q, &s->w);
+    else
+        chunk_next(s->q, &s->w);
+}
+
+/* Cut the chunks off after the last handle written */
+static void chunk_scan_end(struct chunk_scan *s)
+{
+    queue_t *q = s->q;
+    q_chunk_t *c = s->w.c;
+
+    if (s->back) {
+        c->start = s->w.i + 1;
+        while (c->link.prev != &q->chunks)
+            list_move(c->link.prev, &q->spare);
+    } else {
+        c->end = s->w.i;
+        while (c->link.next != &q->chunks)
+            list_move(c->link.next, &q->spare);
+    }
+    if (c->start == c->end)
+        list_move(&c->link, &q->spare);
+}
+
+/* Reverse the order of the chunks and of the handles in each of them */
+static void chunk_reverse(queue_t *q)
+{
+    q_chunk_t *c, *safe;
+
+    list_for_each_entry_safe (c, safe, &q->chunks, link) {
+        for (int i = c->start, j = c->end - 1; i < j; i++, j--) {
+            element_t *tmp = c->items[i];
+            c->items[i] = c->items[j];
+            c->items[j] = tmp;
+        }
+        list_move(&c->link, &q->chunks);
+    }
+}
+
+/* Link the elements of an unrolled queue in order on its head */
+static void chunk_link(queue_t *q)
+{
+    q_chunk_t *c;
+
+    INIT_LIST_HEAD(&q->head);
+    list_for_each_entry (c, &q->chunks, link) {
+        for (int i = c->start; i < c->end; i++)
+            list_add_tail(&c->items[i]->list, &q->head);
+    }
+}
+
+/* Store the elements linked on the queue head back into chunks. This only
+ * fails if the queue has grown without reserving the chunks it needs.
+ */
+static bool chunk_fill(queue_t *q)
+{
+    q_chunk_t *c = NULL;
+    element_t *e;
+
+    list_for_each_entry (e, &q->head, list) {
+        if (!c || c->end == CHUNK_SLOTS) {
+            c = chunk_get(q);
+            if (!c)
+                return false;
+            c->start = c->end = 0;
+            list_add_tail(&c->link, &q->chunks);
+        }
+        c->items[c->end++] = e;
+    }
+    return true;
+}
+
+/*
+ * Ring backend
+ *
+ * A Q_RING queue stores pointers to its elements in one power-of-two array
+ * used as a circular buffer, with the first element at ring[ring_head]. Both
+ * ends are pushed and popped in constant time, the array doubling when full,
+ * and any position is reached by index, so deleting the middle, swapping and
+ * reversing are done in place. The remaining operations go through the list
+ * code like those of Q_UNROLLED, and packing reuses the array, which holds at
+ * least as many slots as the queue ever had elements.
+ */
+
+/* Smallest array a ring is given */
+#define RING_MIN 16
+
+static inline unsigned ring_capacity(const queue_t *q)
+{
+    return q->ring ? q->ring_mask + 1 : 0;
+}
+
+static inline element_t **ring_at(queue_t *q, unsigned i)
+{
+    return &q->ring[(q->ring_head + i) & q->ring_mask];
+}
+
+/* Move the ring into an array of at least n slots, first element at 0 */
+static bool ring_grow(queue_t *q, unsigned n)
+{
+    unsigned cap = RING_MIN;
+    while (cap < n)
+        cap <<= 1;
+    if (cap <= ring_capacity(q))
+        return true;
+
+    element_t **ring = malloc(cap * sizeof(element_t *));
+    if (!ring)
+        return false;
+    for (unsigned i = 0; i < (unsigned) q->size; i++)
+        ring[i] = *ring_at(q, i);
+    free(q->ring);
+    q->ring = ring;
+    q->ring_mask = cap - 1;
+    q->ring_head = 0;
+    return true;
+}
+
+static bool ring_push(queue_t *q, element_t *e, bool tail)
+{
+    if ((unsigned) q->size == ring_capacity(q) &&
+        !ring_grow(q, 2 * q->size))
+        return false;
+
+    if (!tail)
+        q->ring_head = (q->ring_head - 1) & q->ring_mask;
+    *ring_at(q, tail ? q->size : 0) = e;
+    return true;
+}
+
+static element_t *ring_pop(queue_t *q, bool tail)
+{
+    if (tail)
+        return *ring_at(q, q->size - 1);
+
+    element_t *e = *ring_at(q, 0);
+    q->ring_head = (q->ring_head + 1) & q->ring_mask;
+    return e;
+}
+
+static inline void ring_swap(queue_t *q, unsigned i, unsigned j)
+{
+    element_t *tmp = *ring_at(q, i);
+    *ring_at(q, i) = *ring_at(q, j);
+    *ring_at(q, j) = tmp;
+}
+
+/* Reverse the elements at positions [from, to) */
+static void ring_reverse(queue_t *q, unsigned from, unsigned to)
+{
+    while (from + 1 < to)
+        ring_swap(q, from++, --to);
+}
+
+/* Take out the element at position i, shifting the shorter side over it */
+static element_t *ring_delete(queue_t *q, unsigned i)
+{
+    unsigned n = q->size;
+    element_t *e = *ring_at(q, i);
+
+    if (i < n - 1 - i) {
+        for (; i > 0; i--)
+            *ring_at(q, i) = *ring_at(q, i - 1);
+        q->ring_head = (q->ring_head + 1) & q->ring_mask;
+    } else {
+        for (; i < n - 1; i++)
+            *ring_at(q, i) = *ring_at(q, i + 1);
+    }
+    return e;
+}
+
+/* Link the elements of a ring in order on the queue head */
+static void ring_link(queue_t *q)
+{
+    INIT_LIST_HEAD(&q->head);
+    for (unsigned i = 0; i < (unsigned) q->size; i++)
+        list_add_tail(&(*ring_at(q, i))->list, &q->head);
+}
+
+/* Store the elements linked on the queue head back into the ring */
+static void ring_fill(queue_t *q)
+{
+    element_t *e;
+    unsigned i = 0;
+
+    q->ring_head = 0;
+    list_for_each_entry (e, &q->head, list)
+        q->ring[i++] = e;
+}
+
+/*
+ * Indexed backend
+ *
+ * A Q_INDEXED queue is an indexable skip list. Each element is carried by a
+ * node with a random number of forward links, and every link records how many
+ * positions it skips, so walking down from the top level of the sentinel
+ * reaches any position in O(log n) expected steps. Both ends are simply
+ * positions 0 and size. Removed nodes are kept as spares for later insertions.
+ * The remaining operations go through the list code: unpacking keeps all
+ * nodes as spares, and packing threads them again over the elements in their
+ * new order, since the level of a node does not depend on the element it
+ * carries.
+ */
+
+/* Links of the sentinel, enough for 2^SKIP_LEVELS elements */
+#define SKIP_LEVELS 24
+
+typedef struct q_skip {
+    element_t *e;
+    int level; /* Number of links */
+    struct {
+        struct q_skip *next;
+        int width; /* Positions advanced by following next */
+    } link[];
+} q_skip_t;
+
+static inline bool q_indexed(const queue_t *q)
+{
+    return q->backend == Q_INDEXED;
+}
+
+/* Take a spare node, or allocate one of random level */
+static q_skip_t *skip_get(queue_t *q)
+{
+    q_skip_t *x = q->skip_spare;
+    if (x) {
+        q->skip_spare = x->link[0].next;
+        return x;
+    }
+
+    // xorshift32; each further level is taken with probability 1/2
+    uint32_t r = q->skip_seed;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    q->skip_seed = r;
+    int level = 1 + __builtin_ctz(r | 1U << (SKIP_LEVELS - 1));
+
+    x = malloc(sizeof(q_skip_t) + level * sizeof(x->link[0]));
+    if (x)
+        x->level = level;
+    return x;
+}
+
+static void skip_put(queue_t *q, q_skip_t *x)
+{
+    x->link[0].next = q->skip_spare;
+    q->skip_spare = x;
+}
+
+/* Make sure at least n nodes are kept as spares */
+static bool skip_spare(queue_t *q, int n)
+{
+    int have = 0;
+    for (q_skip_t *x = q->skip_spare; x && have < n; x = x->link[0].next)
+        have++;
+    q_skip_t *spare = q->skip_spare;
+    q->skip_spare = NULL;
+    for (; have < n; have++) {
+        q_skip_t *x = skip_get(q);
+        if (!x) {
+            q->skip_spare = spare;
+            return false;
+        }
+        x->link[0].next = spare;
+        spare = x;
+    }
+    q->skip_spare = spare;
+    return true;
+}
+
+/* Find the node before position pos on every level in use, and where it is */
+static void skip_seek(queue_t *q, int pos, q_skip_t **update, int *at)
+{
+    q_skip_t *x = q->skip;
+    int i = -1;
+
+    for (int l = q->skip_top - 1; l >= 0; l--) {
+        while (x->link[l].next && i + x->link[l].width < pos) {
+            i += x->link[l].width;
+            x = x->link[l].next;
+        }
+        update[l] = x;
+        at[l] = i;
+    }
+}
+
+static q_skip_t *skip_at(queue_t *q, int pos)
+{
+    q_skip_t *update[SKIP_LEVELS];
+    int at[SKIP_LEVELS];
+
+    skip_seek(q, pos, update, at);
+    return update[0]->link[0].next;
+}
+
+static bool skip_insert(queue_t *q, element_t *e, int pos)
+{
+    q_skip_t *update[SKIP_LEVELS], *x = skip_get(q);
+    int at[SKIP_LEVELS];
+
+    if (!x)
+        return false;
+    x->e = e;
+    skip_seek(q, pos, update, at);
+    for (; q->skip_top < x->level; q->skip_top++) {
+        update[q->skip_top] = q->skip;
+        at[q->skip_top] = -1;
+        q->skip->link[q->skip_top].next = NULL;
+    }
+
+    for (int l = 0; l < x->level; l++) {
+        q_skip_t *prev = update[l];
+        x->link[l].next = prev->link[l].next;
+        x->link[l].width = at[l] + prev->link[l].width + 1 - pos;
+        prev->link[l].next = x;
+        prev->link[l].width = pos - at[l];
+    }
+    for (int l = x->level; l < q->skip_top; l++)
+        update[l]->link[l].width++;
+    return true;
+}
+
+static element_t *skip_delete(queue_t *q, int pos)
+{
+    q_skip_t *update[SKIP_LEVELS];
+    int at[SKIP_LEVELS];
+
+    skip_seek(q, pos, update, at);
+    q_skip_t *x = update[0]->link[0].next;
+    for (int l = 0; l < q->skip_top; l++) {
+        q_skip_t *prev = update[l];
+        if (prev->link[l].next == x) {
+            prev->link[l].next = x->link[l].next;
+            prev->link[l].width += x->link[l].width - 1;
+        } else {
+            prev->link[l].width--;
+        }
+    }
+    while (q->skip_top && !q->skip->link[q->skip_top - 1].next)
+        q->skip_top--;
+
+    // Kept as a spare, so that an insertion right after needs no allocation
+    element_t *e = x->e;
+    skip_put(q, x);
+    return e;
+}
+
+/* Link the elements of a skip list in order on the queue head */
+static void skip_link(queue_t *q)
+{
+    INIT_LIST_HEAD(&q->head);
+    for (q_skip_t *x = q->skip->link[0].next; x; x = x->link[0].next)
+        list_add_tail(&x->e->list, &q->head);
+}
+
+/* Empty the skip list, keeping its nodes as spares */
+static void skip_release(queue_t *q)
+{
+    q_skip_t *x = q->skip->link[0].next;
+
+    while (x) {
+        q_skip_t *next = x->link[0].next;
+        skip_put(q, x);
+        x = next;
+    }
+    q->skip->link[0].next = NULL;
+    q->skip_top = 0;
+}
+
+/* Thread spare nodes over the elements linked on the queue head. This only
+ * fails if the queue has grown without reserving the nodes it needs, and
+ * leaves the skip list empty then.
+ */
+static bool skip_fill(queue_t *q)
+{
+    q_skip_t *last[SKIP_LEVELS];
+    int at[SKIP_LEVELS], pos = 0;
+    element_t *e;
+
+    for (int l = 0; l < SKIP_LEVELS; l++) {
+        last[l] = q->skip;
+        at[l] = -1;
+    }
+    list_for_each_entry (e, &q->head, list) {
+        q_skip_t *x = skip_get(q);
+        if (!x)
+            break;
+        x->e = e;
+        for (int l = 0; l < x->level; l++) {
+            last[l]->link[l].next = x;
+            last[l]->link[l].width = pos - at[l];
+            last[l] = x;
+            at[l] = pos;
+        }
+        if (q->skip_top < x->level)
+            q->skip_top = x->level;
+        pos++;
+    }
+    for (int l = 0; l < q->skip_top; l++)
+        last[l]->link[l].next = NULL;
+    if (pos == q->size)
+        return true;
+    skip_release(q);
+    return false;
+}
+
+/*
+ * Orientation
+ *
+ * q_reverse() only flips q->reversed. While it is set, the logical head of the
+ * queue is its physical tail, so the ends used by insertion, removal and
+ * peeking are swapped, and positions are counted from the other end. The
+ * operations which reorder or scan a queue work on its physical order and
+ * take the flag into account themselves: sorting and merging read the
+ * elements back to front, scans run the other way, and groups are aligned to
+ * the physical tail. Only q_link(), which hands the links to code outside the
+ * queue, puts the elements in logical order for real with q_normalize().
+ */
+static void q_normalize(queue_t *q)
+{
+    if (!q->reversed)
+        return;
+    q->reversed = false;
+
+    if (q_unrolled(q)) {
+        chunk_reverse(q);
+        return;
+    }
+    if (q->backend == Q_RING) {
+        ring_reverse(q, 0, q->size);
+        return;
+    }
+    if (q_indexed(q)) {
+        skip_link(q);
+        skip_release(q);
+    }
+
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &q->head) {
+        list_move(node, &q->head);
+    }
+    q->mid_pos = q->size - 1 - q->mid_pos;
+    if (q_indexed(q))
+        skip_fill(q);
+}
+
+/* Hand the elements of the queue to the list code, in physical order */
+static void q_unpack(queue_t *q)
+{
+    q->mid = NULL;
+    switch (q->backend) {
+    case Q_UNROLLED:
+        chunk_link(q);
+        list_splice_tail_init(&q->chunks, &q->spare);
+        break;
+    case Q_RING:
+        ring_link(q);
+        break;
+    case Q_INDEXED:
+        skip_link(q);
+        skip_release(q);
+        break;
+    }
+}
+
+/* Store the elements linked on the queue head back into the backend */
+static bool q_pack(queue_t *q)
+{
+    switch (q->backend) {
+    case Q_UNROLLED:
+        return chunk_fill(q);
+    case Q_RING:
+        ring_fill(q);
+        break;
+    case Q_INDEXED:
+        return skip_fill(q);
+    }
+    return true;
+}
+
+/* Take the elements of an unpacked queue off its head as a null-terminated
+ * list in logical order, following the ->prev links under a pending reverse
+ */
+static struct list_head *q_detach(queue_t *q)
+{
+    struct list_head *head = &q->head, *list;
+
+    if (q->reversed) {
+        for (list = head->prev; list != head; list = list->prev)
+            list->next = list->prev;
+        list = head->prev;
+        head->next->next = NULL;
+        q->reversed = false;
+    } else {
+        list = head->next;
+        head->prev->next = NULL;
+    }
+    INIT_LIST_HEAD(head);
+    return list;
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head) * 1);
-    if (!head) {
+    return q_new_backend(Q_LIST);
+}
+
+/* Create an empty queue with the given representation */
+struct list_head *q_new_backend(int backend)
+{
+    if (backend < 0 || backend >= Q_BACKENDS)
+        return NULL;
+
+    queue_t *q = malloc(sizeof(queue_t) * 1);
+    if (!q) {
         return NULL;
     }
-    INIT_LIST_HEAD(head);
-    return head;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->slabs = NULL;
+    q->free_slots = NULL;
+    q->backend = backend;
+    INIT_LIST_HEAD(&q->chunks);
+    INIT_LIST_HEAD(&q->spare);
+    q->ring = NULL;
+    q->ring_mask = 0;
+    q->ring_head = 0;
+    q->reversed = false;
+    q->mid = NULL;
+    q->mid_pos = 0;
+    q->skip = NULL;
+    q->skip_top = 0;
+    q->skip_spare = NULL;
+    q->skip_seed = 0;
+    q->monotone = Q_MONO_NONE;
+    INIT_LIST_HEAD(&q->dropped);
+    if (q_indexed(q)) {
+        q->skip = malloc(sizeof(q_skip_t) +
+                         SKIP_LEVELS * sizeof(q->skip->link[0]));
+        if (!q->skip) {
+            free(q);
+            return NULL;
+        }
+        q->skip->level = SKIP_LEVELS;
+        q->skip->link[0].next = NULL;
+        // Drawn from the seeded generator, so a run with -s can be replayed.
+        // xorshift32 must not start from zero.
+        q->skip_seed = (uint32_t) rand_next() | 1;
+    }
+    return &q->head;
+}
+
+/* Make room for n elements, so that q_merge() need not allocate */
+bool q_reserve(struct list_head *head, int n)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = q_header(head);
+    if (q->backend == Q_RING)
+        return ring_grow(q, n);
+    if (q_indexed(q))
+        return skip_spare(q, n - q->size);
+    if (!q_unrolled(q))
+        return true;
+
+    // Packing fills every chunk, so it needs this many of them at most
+    size_t need = (n + CHUNK_SLOTS - 1) / CHUNK_SLOTS, used = 0;
+    struct list_head *node;
+    list_for_each (node, &q->chunks)
+        used++;
+    return need <= used || chunk_spare(q, need - used);
+}
+
+/* Whether n elements fit in the storage the queue already holds */
+static bool q_has_room(queue_t *q, int n)
+{
+    if (q->backend == Q_RING)
+        return (unsigned) n <= ring_capacity(q);
+    if (q_indexed(q)) {
+        int have = q->size;
+        for (q_skip_t *x = q->skip_spare; x && have < n; x = x->link[0].next)
+            have++;
+        return have >= n;
+    }
+    if (!q_unrolled(q))
+        return true;
+
+    size_t need = (n + CHUNK_SLOTS - 1) / CHUNK_SLOTS, have = 0;
+    struct list_head *node;
+    list_for_each (node, &q->chunks)
+        have++;
+    list_for_each (node, &q->spare)
+        have++;
+    return have >= need;
+}
+
+/* Link the elements of the queue on its head for traversal */
+void q_link(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = q_header(head);
+    q_normalize(q);
+    if (q_unrolled(q))
+        chunk_link(q);
+    else if (q->backend == Q_RING)
+        ring_link(q);
+    else if (q_indexed(q))
+        skip_link(q);
 }
 
 /* Free all storage used by queue */
@@ -36,88 +1034,583 @@ void q_free(struct list_head *head)
     if (!head)
         return;
 
-    // Check if head point to an empty list
-    // Actually, this step is not necessary because the iteration below will do
-    // nothing if the list is empty.
-    if (list_empty(head)) {
-        free(head);  // Even list_empty return true, there is still a dummpy
-                     // list_head.
+    struct list_head *iter = NULL, *safe = NULL;
+    queue_t *q = q_header(head);
+
+    q_release_dropped(q);
+    if (q_unrolled(q)) {
+        q_chunk_t *c;
+        list_for_each_entry (c, &q->chunks, link) {
+            for (int i = c->start; i < c->end; i++)
+                q_release_element(c->items[i]);
+        }
+    } else if (q->backend == Q_RING) {
+        for (unsigned i = 0; i < (unsigned) q->size; i++)
+            q_release_element(*ring_at(q, i));
+        free(q->ring);
+    } else if (q_indexed(q)) {
+        q_skip_t *x, *next;
+        for (x = q->skip->link[0].next; x; x = next) {
+            next = x->link[0].next;
+            q_release_element(x->e);
+            free(x);
+        }
+        for (x = q->skip_spare; x; x = next) {
+            next = x->link[0].next;
+            free(x);
+        }
+        free(q->skip);
+    } else {
+        list_for_each_safe (iter, safe, head) {
+            list_del_init(iter);
+            element_t *e = list_entry(iter, element_t, list);
+            q_release_element(e);
+            // free(iter);
+        }
+    }
+
+    // Slabs still holding elements of other queues are freed by the release
+    // of their last slot.
+    list_splice_tail(&q->chunks, &q->spare);
+    list_for_each_safe (iter, safe, &q->spare)
+        free(list_entry(iter, q_chunk_t, link));
+    for (q_slab_t *slab = q->slabs, *next; slab; slab = next) {
+        next = slab->next;
+        slab->owner = NULL;
+        if (!slab->live)
+            free(slab);
+    }
+    free(q);
+}
+
+/* Allocate an element holding a copy of s. Short strings are kept inline,
+ * longer ones get a block of their own.
+ */
+static element_t *q_new_element(queue_t *q, const char *s)
+{
+    q_slot_t *slot = q_slot_alloc(q);
+    if (!slot)
+        return NULL;
+    element_t *new_e = &slot->elem;
+
+    size_t len = strlen(s) + 1;
+    if (len <= Q_INLINE_LEN) {
+        new_e->value = memcpy(new_e->inline_value, s, len);
+    } else {
+        new_e->value = malloc(len);
+        if (!new_e->value) {
+            new_e->value = new_e->inline_value;
+            q_release_element(new_e);
+            return NULL;
+        }
+        memcpy(new_e->value, s, len);
+    }
+    new_e->prefix = q_prefix(s);
+    return new_e;
+}
+
+static bool monotone_admit(queue_t *q, element_t *e, bool tail);
+static struct list_head *mid_seek(queue_t *q, int pos);
+
+/* Move the middle cursor of a Q_LIST queue back onto the node q_delete_mid()
+ * removes, after elements entered or left at either end. The middle moves by
+ * at most one node per element, so this takes constant time per element,
+ * apart from the first call after an operation which relinked the nodes and
+ * dropped the cursor.
+ */
+static void mid_track(queue_t *q)
+{
+    if (!q->size) {
+        q->mid = NULL;
         return;
     }
 
-    struct list_head *iter = NULL, *safe = NULL;
+    int i = (q->size - 1) / 2, pos = q->reversed ? q->size - 1 - i : i;
+    if (!q->mid) {
+        q->mid = mid_seek(q, pos);
+        q->mid_pos = pos;
+    }
+    for (; q->mid_pos < pos; q->mid_pos++)
+        q->mid = q->mid->next;
+    for (; q->mid_pos > pos; q->mid_pos--)
+        q->mid = q->mid->prev;
+}
 
-    list_for_each_safe (iter, safe, head) {
-        list_del_init(iter);
-        element_t *e = list_entry(iter, element_t, list);
-        q_release_element(e);
-        // free(iter);
+/* Insert a copy of s at either end of the queue */
+static bool q_insert(struct list_head *head, char *s, bool tail)
+{
+    if (!head)
+        return false;
+    queue_t *q = q_header(head);
+    q_release_dropped(q);
+    element_t *new_e = q_new_element(q, s);
+    if (!new_e)
+        return false;
+    if (!monotone_admit(q, new_e, tail)) {
+        q_release_element(new_e);
+        return false;
+    }
+
+    bool ok = true;
+    tail ^= q->reversed;
+    switch (q->backend) {
+    case Q_LIST:
+        if (tail) {
+            list_add_tail(&new_e->list, head);
+        } else {
+            list_add(&new_e->list, head);
+            q->mid_pos++;
+        }
+        break;
+    case Q_UNROLLED:
+        ok = chunk_push(q, new_e, tail);
+        break;
+    case Q_RING:
+        ok = ring_push(q, new_e, tail);
+        break;
+    case Q_INDEXED:
+        ok = skip_insert(q, new_e, tail ? q->size : 0);
+        break;
+    }
+    if (!ok) {
+        q_release_element(new_e);
+        return false;
+    }
+    q->size++;
+    if (q->backend == Q_LIST)
+        mid_track(q);
+
+    return true;
+}
+
+/* Insert n copies of s at either end of the queue, all of them or none */
+bool q_insert_bulk(struct list_head *head, char *s, int n, bool tail)
+{
+    if (!head || n < 0)
+        return false;
+
+    // Room in the backend is made first, so that linking cannot fail
+    queue_t *q = q_header(head);
+    q_release_dropped(q);
+    if (q->backend == Q_RING && !ring_grow(q, q->size + n))
+        return false;
+    if (q_unrolled(q) && !chunk_spare(q, n / CHUNK_SLOTS + 1))
+        return false;
+    if (q_indexed(q) && !skip_spare(q, n))
+        return false;
+
+    LIST_HEAD(batch);
+    for (int i = 0; i < n; i++) {
+        element_t *new_e = q_new_element(q, s);
+        if (!new_e) {
+            element_t *e, *safe;
+            list_for_each_entry_safe (e, safe, &batch, list)
+                q_release_element(e);
+            return false;
+        }
+        list_add_tail(&new_e->list, &batch);
+    }
+
+    if (n && !monotone_admit(q, list_first_entry(&batch, element_t, list),
+                             tail)) {
+        element_t *e, *safe;
+        list_for_each_entry_safe (e, safe, &batch, list)
+            q_release_element(e);
+        return false;
+    }
+
+    tail ^= q->reversed;
+    if (q->backend == Q_LIST) {
+        if (tail) {
+            list_splice_tail(&batch, head);
+        } else {
+            list_splice(&batch, head);
+            q->mid_pos += n;
+        }
+        q->size += n;
+        mid_track(q);
+    } else {
+        // Pushed from the near end of the batch, so that it keeps its order
+        struct list_head *node = tail ? batch.next : batch.prev;
+        for (int i = 0; i < n; i++) {
+            element_t *e = list_entry(node, element_t, list);
+            node = tail ? node->next : node->prev;
+            if (q_unrolled(q))
+                chunk_push(q, e, tail);
+            else if (q_indexed(q))
+                skip_insert(q, e, tail ? q->size : 0);
+            else
+                ring_push(q, e, tail);
+            q->size++;
+        }
+    }
+    return true;
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    return q_insert(head, s, false);
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    return q_insert(head, s, true);
+}
+
+/* Keep the middle cursor on a live node while node leaves either end */
+static void mid_leave(queue_t *q, struct list_head *node, bool tail)
+{
+    if (!q->mid)
+        return;
+
+    if (node != q->mid) {
+        // Everything after the head shifts down by one
+        if (!tail)
+            q->mid_pos--;
+        return;
+    }
+    q->mid = tail ? node->prev : node->next;
+    if (q->mid == &q->head)
+        q->mid = NULL;
+    else if (tail)
+        q->mid_pos--;
+}
+
+/* Unlink the element at either end of a non-empty queue */
+static element_t *q_pop(queue_t *q, bool tail)
+{
+    element_t *ele;
+
+    tail ^= q->reversed;
+    switch (q->backend) {
+    case Q_UNROLLED:
+        ele = chunk_pop(q, tail);
+        break;
+    case Q_RING:
+        ele = ring_pop(q, tail);
+        break;
+    case Q_INDEXED:
+        ele = skip_delete(q, tail ? q->size - 1 : 0);
+        break;
+    default:
+        ele = tail ? list_last_entry(&q->head, element_t, list)
+                   : list_first_entry(&q->head, element_t, list);
+        mid_leave(q, &ele->list, tail);
+        list_del(&ele->list);
+        break;
+    }
+    q->size--;
+    if (q->backend == Q_LIST)
+        mid_track(q);
+    return ele;
+}
+
+/* Unlink the element at either end of queue and copy its string to sp */
+static element_t *q_remove(struct list_head *head,
+                           bool tail,
+                           char *sp,
+                           size_t bufsize)
+{
+    element_t *ele = q_pop(q_header(head), tail);
+
+    // Only the string itself is copied; strncpy() would also zero-fill the
+    // rest of the buffer.
+    if (sp && bufsize) {
+        size_t len = strnlen(ele->value, bufsize - 1);
+        memcpy(sp, ele->value, len);
+        sp[len] = '\0';
+    }
+    return ele;
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !q_header(head)->size)
+        return NULL;
+
+    return q_remove(head, false, sp, bufsize);
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !q_header(head)->size)
+        return NULL;
+
+    return q_remove(head, true, sp, bufsize);
+}
+
+/* Move up to n elements from either end of queue to the tail of out */
+int q_remove_bulk(struct list_head *head,
+                  struct list_head *out,
+                  int n,
+                  bool tail)
+{
+    if (!head || !out)
+        return 0;
+
+    queue_t *q = q_header(head);
+    int cnt = 0;
+    for (; cnt < n && q->size; cnt++)
+        list_add_tail(&q_pop(q, tail)->list, out);
+    return cnt;
+}
+
+/* Get the element at either end of a non-empty queue */
+static element_t *q_peek(queue_t *q, bool tail)
+{
+    tail ^= q->reversed;
+    if (q_unrolled(q))
+        return chunk_peek(q, tail);
+    if (q->backend == Q_RING)
+        return *ring_at(q, tail ? q->size - 1 : 0);
+    if (q_indexed(q))
+        return skip_at(q, tail ? q->size - 1 : 0)->e;
+    return tail ? list_last_entry(&q->head, element_t, list)
+                : list_first_entry(&q->head, element_t, list);
+}
+
+/* Get the element at head of queue */
+element_t *q_peek_head(struct list_head *head)
+{
+    if (!head || !q_header(head)->size)
+        return NULL;
+
+    return q_peek(q_header(head), false);
+}
+
+/* Get the element at tail of queue */
+element_t *q_peek_tail(struct list_head *head)
+{
+    if (!head || !q_header(head)->size)
+        return NULL;
+
+    return q_peek(q_header(head), true);
+}
+
+/*
+ * Monotone queues
+ *
+ * A queue set by q_set_monotone() stays in the state q_ascend() or
+ * q_descend() would leave it in. Inserting at the tail pops the elements which
+ * break the order off the tail first, as with a monotonic stack, so each
+ * element is released at most once. Removing elements cannot break the order,
+ * and the operations which reorder a queue finish with monotone_scan(). Those
+ * run where free() is off limits, so the scan only moves what it removes onto
+ * the dropped list, and the caller releases it when it may.
+ */
+
+/* Keep a monotone queue in order as e is inserted at either end. Elements
+ * breaking the order before a new tail are released; false means that e
+ * would break it at the head and has to be dropped instead.
+ *
+ * Popping leaves room for the push that follows, so an insertion which has
+ * released elements cannot fail afterwards.
+ */
+static bool monotone_admit(queue_t *q, element_t *e, bool tail)
+{
+    if (!q->monotone || !q->size)
+        return true;
+
+    bool descend = q->monotone == Q_MONO_DESCEND;
+    if (!tail)
+        return q_cmp(&e->list, &q_peek(q, false)->list, descend) <= 0;
+    while (q->size && q_cmp(&q_peek(q, true)->list, &e->list, descend) > 0)
+        q_release_element(q_pop(q, true));
+    return true;
+}
+
+/* Take e out of the count of q and keep it for q_release_dropped() */
+static void monotone_drop(queue_t *q, element_t *e)
+{
+    list_add_tail(&e->list, &q->dropped);
+    q->size--;
+}
+
+/* Remove every node which comes after a node on its right side in the given
+ * order, scanning from the tail. The removed elements are only dropped.
+ */
+static void monotone_scan(queue_t *q, bool descend)
+{
+    struct list_head *head = &q->head, *standard, *compare, *safe;
+
+    if (q->size < 2)
+        return;
+
+    // Under a pending reverse the logical tail is the physical head
+    bool forward = q->reversed;
+    if (q_unrolled(q)) {
+        struct chunk_scan scan;
+        element_t *e, *top;
+
+        chunk_scan_init(&scan, q, !forward);
+        top = chunk_scan_next(&scan);
+        chunk_scan_keep(&scan, top);
+        while ((e = chunk_scan_next(&scan))) {
+            if (q_cmp(&e->list, &top->list, descend) > 0) {
+                monotone_drop(q, e);
+            } else {
+                chunk_scan_keep(&scan, e);
+                top = e;
+            }
+        }
+        chunk_scan_end(&scan);
+        return;
     }
-    free(head);
+
+    q_unpack(q);
+    standard = forward ? head->next : head->prev;
+    for (compare = forward ? standard->next : standard->prev; compare != head;
+         compare = safe) {
+        safe = forward ? compare->next : compare->prev;
+        if (q_cmp(compare, standard, descend) > 0) {
+            list_del(compare);
+            monotone_drop(q, list_entry(compare, element_t, list));
+        } else {
+            standard = compare;
+        }
+    }
+
+    q_pack(q);
+}
+
+/* Restore the order of a monotone queue after it may have been reordered */
+static void q_keep_monotone(queue_t *q)
+{
+    if (q->monotone)
+        monotone_scan(q, q->monotone == Q_MONO_DESCEND);
 }
 
-/* Insert an element at head of queue */
-bool q_insert_head(struct list_head *head, char *s)
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
 {
-    if (!head)
-        return false;
-    element_t *new_e = (element_t *) malloc(sizeof(element_t) * 1);
-    char *sdup = strdup(s);
-    if (!new_e || !sdup) {
-        free(new_e);
-        free(sdup);
-        return false;
+    if (!head) {
+        return -1;
     }
-    new_e->value = sdup;
-    char *p = s;
-    *p++ = *s++;
-    list_add(&new_e->list, head);
-
-    return true;
+    return q_header(head)->size;
 }
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+/* Bytes of the string of e which are kept outside its slot */
+static inline size_t q_string_bytes(const element_t *e)
 {
-    if (!head)
-        return false;
-    return q_insert_head(head->prev, s);
+    return e->value == e->inline_value ? 0 : strlen(e->value) + 1;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/* Return the bytes held by queue */
+size_t q_footprint(struct list_head *head)
 {
-    if (!head || list_empty(head))
-        return NULL;
-
-    element_t *ele = list_entry(head->next, element_t, list);
-    list_del(head->next);
+    if (!head)
+        return 0;
 
-    if (sp) {
-        strncpy(sp, ele->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+    queue_t *q = q_header(head);
+    size_t bytes = sizeof(queue_t);
+    for (q_slab_t *slab = q->slabs; slab; slab = slab->next)
+        bytes += sizeof(q_slab_t) + slab->cap * sizeof(q_slot_t);
+
+    switch (q->backend) {
+    case Q_UNROLLED: {
+        q_chunk_t *c;
+        list_for_each_entry (c, &q->chunks, link) {
+            bytes += sizeof(q_chunk_t);
+            for (int i = c->start; i < c->end; i++)
+                bytes += q_string_bytes(c->items[i]);
+        }
+        list_for_each_entry (c, &q->spare, link)
+            bytes += sizeof(q_chunk_t);
+        break;
     }
-    return ele;
+    case Q_RING:
+        bytes += ring_capacity(q) * sizeof(element_t *);
+        for (unsigned i = 0; i < (unsigned) q->size; i++)
+            bytes += q_string_bytes(*ring_at(q, i));
+        break;
+    case Q_INDEXED:
+        bytes += sizeof(q_skip_t) + SKIP_LEVELS * sizeof(q->skip->link[0]);
+        for (q_skip_t *x = q->skip->link[0].next; x; x = x->link[0].next) {
+            bytes += sizeof(q_skip_t) + x->level * sizeof(x->link[0]);
+            bytes += q_string_bytes(x->e);
+        }
+        for (q_skip_t *x = q->skip_spare; x; x = x->link[0].next)
+            bytes += sizeof(q_skip_t) + x->level * sizeof(x->link[0]);
+        break;
+    default: {
+        element_t *e;
+        list_for_each_entry (e, head, list)
+            bytes += q_string_bytes(e);
+        break;
+    }
+    }
+
+    element_t *e;
+    list_for_each_entry (e, &q->dropped, list)
+        bytes += q_string_bytes(e);
+    return bytes;
 }
 
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+/* Find the node at physical position pos, stepping from the middle cursor
+ * when it is closer than either end
+ */
+static struct list_head *mid_seek(queue_t *q, int pos)
 {
-    return q_remove_head(head->prev->prev, sp, bufsize);
+    int n = q->size, at, near = pos < n - 1 - pos ? pos : n - 1 - pos;
+    struct list_head *node;
+
+    if (q->mid && abs(pos - q->mid_pos) <= near) {
+        node = q->mid;
+        at = q->mid_pos;
+    } else if (pos == near) {
+        node = q->head.next;
+        at = 0;
+    } else {
+        node = q->head.prev;
+        at = n - 1;
+    }
+    for (; at < pos; at++)
+        node = node->next;
+    for (; at > pos; at--)
+        node = node->prev;
+    return node;
 }
 
-/* Return number of elements in queue */
-int q_size(struct list_head *head)
+/* Delete the element at logical position i of a queue */
+static void q_delete_pos(queue_t *q, int i)
 {
-    if (!head) {
-        return -1;
+    q_release_dropped(q);
+
+    // Positions are resolved physically, so a pending reverse need not be
+    // carried out first.
+    int pos = q->reversed ? q->size - 1 - i : i;
+
+    element_t *e;
+    if (q_unrolled(q)) {
+        e = chunk_delete(q, pos);
+    } else if (q->backend == Q_RING) {
+        e = ring_delete(q, pos);
+    } else if (q_indexed(q)) {
+        e = skip_delete(q, pos);
+    } else {
+        struct list_head *node = mid_seek(q, pos);
+
+        // The cursor stays on its node, or moves to a neighbour of it
+        if (node != q->mid) {
+            if (pos < q->mid_pos)
+                q->mid_pos--;
+        } else if (node->next != &q->head) {
+            q->mid = node->next;
+        } else {
+            q->mid = node->prev;
+            q->mid_pos--;
+        }
+        list_del(node);
+        e = list_entry(node, element_t, list);
     }
-    int size = 0;
-
-    struct list_head *iter = NULL;
-    list_for_each (iter, head)
-        size++;
-    return size;
+    q->size--;
+    if (q->backend == Q_LIST)
+        mid_track(q);
+    q_release_element(e);
 }
 
 /* Delete the middle node in queue */
@@ -125,22 +1618,78 @@ bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
 
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
+        return false;
+
+    q_delete_pos(q_header(head), (q_header(head)->size - 1) / 2);
+    return true;
+}
+
+/* Get the element at position i of queue */
+element_t *q_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= q_header(head)->size)
+        return NULL;
+
+    queue_t *q = q_header(head);
+    int pos = q->reversed ? q->size - 1 - i : i;
+    switch (q->backend) {
+    case Q_UNROLLED: {
+        struct chunk_pos p = chunk_seek(q, pos);
+        return p.c->items[p.i];
+    }
+    case Q_RING:
+        return *ring_at(q, pos);
+    case Q_INDEXED:
+        return skip_at(q, pos)->e;
+    default:
+        return list_entry(mid_seek(q, pos), element_t, list);
+    }
+}
+
+/* Insert a copy of s at position i of queue */
+bool q_insert_at(struct list_head *head, int i, char *s)
+{
+    if (!head || i < 0 || i > q_header(head)->size)
         return false;
 
-    struct list_head *next = head->next, *prev = head->prev;
+    // Room in the backend is made first, so that linking cannot fail
+    queue_t *q = q_header(head);
+    if (!q_reserve(head, q->size + 1))
+        return false;
+    element_t *new_e = q_new_element(q, s);
+    if (!new_e)
+        return false;
 
-    while (next != prev && next->next != prev) {
-        next = next->next;
-        prev = prev->prev;
+    bool packed = q_unrolled(q) || q->backend == Q_RING;
+    if (packed)
+        q_unpack(q);
+    int pos = q->reversed ? q->size - i : i;
+    if (q_indexed(q)) {
+        skip_insert(q, new_e, pos);
+    } else {
+        list_add_tail(&new_e->list,
+                      pos == q->size ? &q->head : mid_seek(q, pos));
+        if (q->mid && pos <= q->mid_pos)
+            q->mid_pos++;
     }
-    // delete next
+    q->size++;
+    if (q->backend == Q_LIST)
+        mid_track(q);
+    if (packed && !q_pack(q))
+        return false;
+    q_keep_monotone(q);
+    q_release_dropped(q);
+    return true;
+}
 
-    list_del(next);
-    // free(list_entry(next, element_t, list));
-    q_release_element(list_entry(next, element_t, list));
-    // free(next);
+/* Delete the element at position i of queue */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= q_header(head)->size)
+        return false;
 
+    q_delete_pos(q_header(head), i);
     return true;
 }
 
@@ -149,9 +1698,35 @@ bool q_delete_dup(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
 
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
         return false;
 
+    queue_t *q = q_header(head);
+    q_release_dropped(q);
+    if (q_unrolled(q)) {
+        struct chunk_scan scan;
+        element_t *e, *next;
+        bool dup = false;
+
+        // An element equal to the next one goes, and so does the last of a
+        // run of equal elements
+        chunk_scan_init(&scan, q, false);
+        for (e = chunk_scan_next(&scan); e; e = next) {
+            next = chunk_scan_next(&scan);
+            bool same = next && !q_cmp(&e->list, &next->list, false);
+            if (same || dup) {
+                q_release_element(e);
+                q->size--;
+            } else {
+                chunk_scan_keep(&scan, e);
+            }
+            dup = same;
+        }
+        chunk_scan_end(&scan);
+        return true;
+    }
+
+    q_unpack(q);
     struct list_head *current = head->next, *remove;
 
     while (current != head) {
@@ -162,11 +1737,12 @@ bool q_delete_dup(struct list_head *head)
         while (remove != head) {
             element_t *remv_ele = list_entry(remove, element_t, list);
 
-            if (!strcmp(remv_ele->value, cur_ele->value)) {
+            if (!q_cmp(remove, current, false)) {
                 // element_t *node = remove;
                 list_del(remove);
                 remove = remove->next;
                 q_release_element(remv_ele);
+                q_header(head)->size--;
                 check = true;
             } else {
                 // remove = remove->next;
@@ -177,60 +1753,148 @@ bool q_delete_dup(struct list_head *head)
             list_del(current);
             current = current->next;
             q_release_element(cur_ele);
+            q_header(head)->size--;
         } else {
             current = current->next;
         }
     }
 
+    return q_pack(q);
+}
 
-    return true;
+/* 64-bit FNV-1a hash of a string */
+static uint64_t q_hash(const char *s)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
 }
 
-/* Swap every two adjacent nodes */
-void q_swap(struct list_head *head)
+struct dup_slot {
+    uint64_t hash;
+    element_t *first; /* Earliest element holding the string */
+    bool dup;         /* The string occurred again later */
+};
+
+/* Find the slot claimed by the string of e, or the free slot it would claim */
+static struct dup_slot *dup_find(struct dup_slot *table,
+                                 size_t mask,
+                                 const element_t *e)
 {
-    // https://leetcode.com/problems/swap-nodes-in-pairs/
+    uint64_t hash = q_hash(e->value);
+    size_t i = hash & mask;
 
-    if (!head || list_empty(head))
-        return;
+    for (; table[i].first; i = (i + 1) & mask) {
+        if (table[i].hash == hash &&
+            !q_cmp(&table[i].first->list, &e->list, false))
+            break;
+    }
+    table[i].hash = hash;
+    return &table[i];
+}
 
-    struct list_head **indir = &head->next;
+/* Delete all nodes that have duplicate string, in a queue of any order */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (!head || !q_header(head)->size)
+        return false;
+
+    /* Open addressing with linear probing, kept at most half full */
+    queue_t *q = q_header(head);
+    q_release_dropped(q);
+    size_t mask = 1;
+    while (mask < 2 * (size_t) q->size)
+        mask <<= 1;
+    struct dup_slot *table = calloc(mask--, sizeof(struct dup_slot));
+    if (!table)
+        return false;
 
-    while (*indir != head && (*indir)->next != head) {
-        struct list_head *node = *indir;
-        node->next->prev = node->prev;
-        node->prev->next = node->next;
+    /* The first occurrence of each string claims a slot; any later one is
+     * released on the spot, and the claiming element is marked to go too.
+     */
+    element_t *e, *safe;
+    struct dup_slot *slot;
+    if (q_unrolled(q)) {
+        // The marked elements are found by a second scan, looking each
+        // survivor up again, as chunks give no way to unlink one directly
+        struct chunk_scan scan;
+        bool dup = false;
+
+        chunk_scan_init(&scan, q, false);
+        while ((e = chunk_scan_next(&scan))) {
+            slot = dup_find(table, mask, e);
+            if (!slot->first) {
+                slot->first = e;
+                chunk_scan_keep(&scan, e);
+                continue;
+            }
+            slot->dup = dup = true;
+            q_release_element(e);
+            q->size--;
+        }
+        chunk_scan_end(&scan);
+
+        if (dup) {
+            chunk_scan_init(&scan, q, false);
+            while ((e = chunk_scan_next(&scan))) {
+                if (dup_find(table, mask, e)->dup) {
+                    q_release_element(e);
+                    q->size--;
+                } else {
+                    chunk_scan_keep(&scan, e);
+                }
+            }
+            chunk_scan_end(&scan);
+        }
+        free(table);
+        return true;
+    }
 
-        (*indir)->next->prev = node;
-        node->next = (*indir)->next;
-        node->prev = (*indir);
-        (*indir)->next = node;
+    q_unpack(q);
+    list_for_each_entry_safe (e, safe, head, list) {
+        slot = dup_find(table, mask, e);
+        if (!slot->first) {
+            slot->first = e;
+            continue;
+        }
+        slot->dup = true;
+        list_del(&e->list);
+        q_release_element(e);
+        q->size--;
+    }
 
-        indir = &(*indir)->next->next;
+    for (size_t i = 0; i <= mask; i++) {
+        if (!table[i].dup)
+            continue;
+        list_del(&table[i].first->list);
+        q_release_element(table[i].first);
+        q->size--;
     }
+    free(table);
+    return q_pack(q);
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    // https://leetcode.com/problems/swap-nodes-in-pairs/
+
+    // Swapping pairs is reversing groups of two
+    q_reverseK(head, 2);
 }
 
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
         return;
 
-    // int size = q_size(head);
-    struct list_head *node, *safe;
-
-    // for (int i = 0; i < size - 1; i++) {
-    //     struct list_head *node = prev;
-    //     prev = node->prev;
-
-    //     list_del(node);
-    //     list_add(node, cur);
-
-    //     cur = cur->next;
-    // }
-    list_for_each_safe (node, safe, head) {
-        list_move(node, head);
-    }
+    // Only the orientation flips; the other operations follow it
+    q_header(head)->reversed ^= true;
+    q_keep_monotone(q_header(head));
 }
 
 /* Reverse the nodes of the list k at a time */
@@ -238,72 +1902,608 @@ void q_reverseK(struct list_head *head, int k)
 {
     // https://leetcode.com/problems/reverse-nodes-in-k-group/
 
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size || k < 2)
+        return;
+
+    queue_t *q = q_header(head);
+    // Reversing a group reads the same either way round, so under a pending
+    // reverse the groups are just aligned to the physical tail instead.
+    int groups = q->size / k, skip = q->reversed ? q->size % k : 0;
+    if (q->backend == Q_RING) {
+        for (int i = skip; groups--; i += k)
+            ring_reverse(q, i, i + k);
+        q_keep_monotone(q);
+        return;
+    }
+    if (q_unrolled(q)) {
+        if (groups)
+            chunk_reverse_groups(q, skip, k, groups);
+        q_keep_monotone(q);
         return;
+    }
+
+    if (q_indexed(q))
+        q_unpack(q);
+    struct list_head *prev = head;
+    while (skip--)
+        prev = prev->next;
+
+    // One pass: the links of each node are swapped as it is passed, and the
+    // ends of the group are then joined to its neighbours.
+    for (; groups; groups--) {
+        struct list_head *first = prev->next, *node = first, *last = prev;
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            node->next = last;
+            node->prev = next;
+            last = node;
+            node = next;
+        }
+        prev->next = last;
+        last->prev = prev;
+        first->next = node;
+        node->prev = first;
+        prev = first;
+    }
+    q->mid = NULL;
+    q_pack(q);
+    q_keep_monotone(q);
+}
+
+/* Choose the engine used by q_sort() */
+bool q_set_sort_algo(int algo)
+{
+    if (algo < 0 || algo >= Q_SORT_ALGOS)
+        return false;
+    sort_algo = algo;
+    return true;
+}
+
+/* Choose how many threads q_sort() uses on large queues */
+bool q_set_sort_threads(int n)
+{
+    if (n < 1 || n > Q_MAX_SORT_THREADS)
+        return false;
+    sort_threads = n;
+    return true;
+}
+
+/* Sort a null-terminated list of n nodes with the selected engine */
+static struct list_head *sort_list(struct list_head *list,
+                                   size_t n,
+                                   bool descend)
+{
+    switch (sort_algo) {
+    case Q_SORT_ADAPTIVE:
+        return timsort(list, n, descend);
+    case Q_SORT_RADIX:
+        return radixsort(list, n, descend);
+    default:
+        return mergesort(list, descend);
+    }
+}
 
-    int size = q_size(head);
-    struct list_head *cur = head, *new_head;
+/*
+ * Parallel sort.
+ *
+ * The list is cut into one segment per thread, which is cheap since the size
+ * is cached. Every segment is sorted by its own thread with the selected
+ * engine, and the sorted segments are then merged pairwise, each round of the
+ * merge tree running its merges concurrently. Segments are merged with the
+ * earlier one on the left, so the result stays stable. Below this size the
+ * cost of starting threads outweighs the gain.
+ */
+#define PARALLEL_SORT_MIN 65536
 
-    while (size >= k) {
-        struct list_head *tail = cur;
-        for (int i = 0; i < k; i++)
-            tail = tail->next;
-        new_head = tail->next;  // Memorize the begining node of next iteration.
+struct sort_task {
+    struct list_head *list;  /* Segment to sort, or left list to merge */
+    struct list_head *other; /* Right list to merge, NULL to sort */
+    size_t len;
+    bool descend;
+};
 
-        for (int i = 0; i < k - 1; i++) {
-            struct list_head *node = tail;
-            tail = tail->prev;
+static void *sort_worker(void *arg)
+{
+    struct sort_task *task = arg;
 
-            list_move(node, cur);
+    if (task->other)
+        task->list = merge2SortedLists(task->list, task->other, task->descend);
+    else
+        task->list = sort_list(task->list, task->len, task->descend);
+    return NULL;
+}
 
-            cur = cur->next;
+/* Run n tasks concurrently, the first one on the calling thread */
+static void run_tasks(struct sort_task *tasks, int n)
+{
+    pthread_t tid[Q_MAX_SORT_THREADS];
+    bool spawned[Q_MAX_SORT_THREADS];
+
+    for (int i = 1; i < n; i++)
+        spawned[i] = !pthread_create(&tid[i], NULL, sort_worker, &tasks[i]);
+    sort_worker(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        // A task whose thread could not be started runs here instead
+        if (spawned[i])
+            pthread_join(tid[i], NULL);
+        else
+            sort_worker(&tasks[i]);
+    }
+}
+
+static struct list_head *parallel_sort(struct list_head *list,
+                                       size_t n,
+                                       int nthreads,
+                                       bool descend)
+{
+    struct sort_task tasks[Q_MAX_SORT_THREADS];
+
+    for (int i = 0; i < nthreads; i++) {
+        size_t len = n / nthreads + ((size_t) i < n % nthreads);
+
+        tasks[i] = (struct sort_task){
+            .list = list, .other = NULL, .len = len, .descend = descend};
+        while (--len)
+            list = list->next;
+        struct list_head *next = list->next;
+        list->next = NULL;
+        list = next;
+    }
+
+    run_tasks(tasks, nthreads);
+    for (int c = nthreads; c > 1; c = (c + 1) / 2) {
+        for (int j = 0; j < c / 2; j++) {
+            tasks[j].list = tasks[2 * j].list;
+            tasks[j].other = tasks[2 * j + 1].list;
         }
+        run_tasks(tasks, c / 2);
+        if (c & 1)
+            tasks[c / 2].list = tasks[c - 1].list;
+    }
+    return tasks[0].list;
+}
 
-        size -= k;
-        cur = new_head->prev;
+/* Hang the null-terminated list on head and rebuild its ->prev pointers */
+static void list_relink(struct list_head *head, struct list_head *list)
+{
+    struct list_head *cur = head;
+    for (; list; list = list->next) {
+        cur->next = list;
+        list->prev = cur;
+        cur = list;
     }
+    cur->next = head;
+    head->prev = cur;
 }
 
 /* Sort elements of queue in ascending/descending order */
 void q_sort(struct list_head *head, bool descend)
 {
     // NULL, empty or only one element exists->do nothing.
-    if (!head || (head->next == head->prev))
+    if (!head || q_header(head)->size < 2)
         return;
 
-    head->prev->next = NULL;
+    /* The harness abandons an operation which runs too long by jumping out of
+     * its SIGALRM handler. Neither a sort worker, nor the caller waiting for
+     * the workers, nor a queue whose nodes are only singly linked may be left
+     * that way, so the signal is held until the queue is whole again, and is
+     * delivered then if the limit expired.
+     */
+    sigset_t alarm, old;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &old);
+
+    q_unpack(q_header(head));
+    struct list_head *list = q_detach(q_header(head));
+
+    size_t n = q_header(head)->size;
+    if (sort_threads > 1 && n >= PARALLEL_SORT_MIN)
+        list = parallel_sort(list, n, sort_threads, descend);
+    else
+        list = sort_list(list, n, descend);
+
+    list_relink(head, list);
+    q_pack(q_header(head));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    q_keep_monotone(q_header(head));
+}
+
+/* Push the sorted sublist on pending, which holds count sublists so far */
+static struct list_head *pending_push(struct list_head *pending,
+                                      struct list_head *sublist,
+                                      size_t count,
+                                      bool descend)
+{
+    size_t bits;
+    struct list_head **tail = &pending;
+
+    // Find the least-significant clear bit in count; the two sublists
+    // below it have the same size and are merged.
+    for (bits = count; bits & 1; bits >>= 1)
+        tail = &(*tail)->prev;
+    if (bits) {
+        struct list_head *a = *tail, *b = a->prev;
+
+        a = merge2SortedLists(b, a, descend);
+        a->prev = b->prev;
+        *tail = a;
+    }
+
+    sublist->prev = pending;
+    return sublist;
+}
+
+/* Merge all the pending sublists together, from the newest to the oldest */
+static struct list_head *pending_collapse(struct list_head *pending,
+                                          bool descend)
+{
+    struct list_head *list = pending;
 
-    head->next = mergesort(head->next, descend);
+    for (pending = pending->prev; pending;) {
+        struct list_head *next = pending->prev;
 
-    struct list_head *cur = head, *next = head->next;
-    while (next) {
-        next->prev = cur;
-        cur = next;
-        next = next->next;
+        list = merge2SortedLists(pending, list, descend);
+        pending = next;
     }
-    cur->next = head;
-    head->prev = cur;
+    return list;
 }
 
+/*
+ * Bottom-up merge sort of a null-terminated list, in the manner of list_sort()
+ * in the Linux kernel.
+ *
+ * Nodes are taken one at a time and pushed onto a stack of pending sorted
+ * sublists, chained through their ->prev pointers. The sizes of the pending
+ * sublists are distinct powers of two and follow the binary representation of
+ * the number of nodes taken so far: whenever that count gains a carry, the two
+ * newest sublists of equal size are merged. At the end the pending sublists are
+ * merged from the smallest up. No midpoint has to be searched for and no
+ * recursion is needed, and merges stay at most 2:1 unbalanced, which keeps the
+ * working set of each merge small enough to remain in cache.
+ *
+ * A newer sublist always holds nodes which came later in the input, so passing
+ * the older one as the left operand of merge2SortedLists() keeps the sort
+ * stable. The ->prev pointers are left dangling and are rebuilt by q_sort().
+ */
 struct list_head *mergesort(struct list_head *head, bool descend)
 {
+    struct list_head *list = head, *pending = NULL;
+    size_t count = 0;
+
     if (!head || !head->next)
         return head;
 
-    struct list_head *fast = head, *slow = head;
+    do {
+        struct list_head *node = list;
+
+        // Move one node from the input to pending as a sublist of size one
+        list = list->next;
+        node->next = NULL;
+        pending = pending_push(pending, node, count++, descend);
+    } while (list);
+
+    return pending_collapse(pending, descend);
+}
+
+/*
+ * Adaptive natural merge sort in the style of Timsort.
+ *
+ * The input is cut into runs which are already in order: a non-descending
+ * run is taken as is, and a strictly descending run is reversed while it is
+ * scanned (strictness keeps equal nodes in their original order). Runs
+ * shorter than minrun are extended by stable insertion. Runs are kept on a
+ * small stack and merged under the invariants of Timsort, which bound the
+ * stack depth by the logarithm of the length, so a fixed array on the stack
+ * is enough and nothing is allocated.
+ *
+ * Merging first checks whether the two runs are already in order, which
+ * makes presorted and reversed input linear. Otherwise, once one run has won
+ * MIN_GALLOP times in a row, the merge gallops: it probes 1, 2, 4, ... nodes
+ * ahead in the winning run and then bisects, so a long block is spliced with a
+ * logarithmic number of comparisons.
+ */
+
+#define MIN_GALLOP 7
+#define MAX_RUNS 85
+
+struct run {
+    struct list_head *head, *tail;
+    size_t len;
+};
+
+static size_t run_min(size_t n)
+{
+    size_t r = 0;
+    while (n >= 64) {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
+}
+
+/* Take the next run from *list, extended to at least minrun nodes */
+static struct run run_find(struct list_head **list,
+                           size_t minrun,
+                           bool descend)
+{
+    struct run run = {.head = *list, .tail = *list, .len = 1};
+    struct list_head *cur = run.head->next;
+
+    if (cur && q_cmp(run.head, cur, descend) > 0) {
+        do {
+            struct list_head *next = cur->next;
+            cur->next = run.head;
+            run.head = cur;
+            cur = next;
+            run.len++;
+        } while (cur && q_cmp(run.head, cur, descend) > 0);
+    } else {
+        while (cur && q_cmp(run.tail, cur, descend) <= 0) {
+            run.tail = cur;
+            cur = cur->next;
+            run.len++;
+        }
+    }
+    run.tail->next = NULL;
+
+    while (cur && run.len < minrun) {
+        struct list_head *node = cur;
+        cur = cur->next;
+
+        // Insert after the last node not greater than node
+        if (q_cmp(run.tail, node, descend) <= 0) {
+            run.tail->next = node;
+            run.tail = node;
+            node->next = NULL;
+        } else if (q_cmp(run.head, node, descend) > 0) {
+            node->next = run.head;
+            run.head = node;
+        } else {
+            struct list_head *pos = run.head;
+            while (q_cmp(pos->next, node, descend) <= 0)
+                pos = pos->next;
+            node->next = pos->next;
+            pos->next = node;
+        }
+        run.len++;
+    }
+
+    *list = cur;
+    return run;
+}
+
+/* Starting from node, which comes before key, return the last node of the
+ * block that comes before key: before means q_cmp() <= 0 if inclusive,
+ * and < 0 otherwise.
+ */
+static struct list_head *run_gallop(struct list_head *node,
+                                    const struct list_head *key,
+                                    bool inclusive,
+                                    bool descend)
+{
+    int limit = inclusive ? 0 : -1;
+    struct list_head *good = node;
+    size_t gap = 0;
+
+    // Exponential search: the block ends in (good, good + gap]
+    for (size_t step = 1;; step <<= 1) {
+        struct list_head *probe = good;
+        for (gap = 0; gap < step && probe->next; gap++)
+            probe = probe->next;
+        if (!gap)
+            return good;
+        if (q_cmp(probe, key, descend) > limit)
+            break;
+        good = probe;
+        if (gap < step)
+            return good;
+    }
+
+    // Bisection: good is inside the block, good + gap is not
+    while (gap > 1) {
+        size_t half = gap / 2;
+        struct list_head *probe = good;
+        for (size_t i = 0; i < half; i++)
+            probe = probe->next;
+        if (q_cmp(probe, key, descend) <= limit) {
+            good = probe;
+            gap -= half;
+        } else {
+            gap = half;
+        }
+    }
+    return good;
+}
+
+/* Merge run b into run a, which holds the nodes that came first */
+static struct run run_merge(struct run a, struct run b, bool descend)
+{
+    struct run out = {.len = a.len + b.len};
+
+    if (q_cmp(a.tail, b.head, descend) <= 0) {
+        a.tail->next = b.head;
+        out.head = a.head;
+        out.tail = b.tail;
+        return out;
+    }
+    if (q_cmp(b.tail, a.head, descend) < 0) {
+        b.tail->next = a.head;
+        out.head = b.head;
+        out.tail = a.tail;
+        return out;
+    }
+
+    struct list_head *x = a.head, *y = b.head;
+    struct list_head **indir = &out.head;
+    int x_wins = 0, y_wins = 0;
+
+    while (x && y) {
+        struct list_head *last;
+        if (q_cmp(x, y, descend) <= 0) {
+            y_wins = 0;
+            last = ++x_wins < MIN_GALLOP ? x
+                                         : run_gallop(x, y, true, descend);
+            *indir = x;
+            x = last->next;
+        } else {
+            x_wins = 0;
+            last = ++y_wins < MIN_GALLOP ? y
+                                         : run_gallop(y, x, false, descend);
+            *indir = y;
+            y = last->next;
+        }
+        indir = &last->next;
+    }
+    *indir = x ? x : y;
+    out.tail = x ? a.tail : b.tail;
+    return out;
+}
+
+/* Merge runs[i] and runs[i + 1] of the n runs on the stack */
+static void run_merge_at(struct run *runs, int i, int n, bool descend)
+{
+    runs[i] = run_merge(runs[i], runs[i + 1], descend);
+    if (i + 2 < n)
+        runs[i + 1] = runs[i + 2];
+}
+
+struct list_head *timsort(struct list_head *list, size_t n, bool descend)
+{
+    struct run runs[MAX_RUNS];
+    int nr = 0;
+    size_t minrun = run_min(n);
+
+    if (!list || !list->next)
+        return list;
+
+    while (list) {
+        runs[nr++] = run_find(&list, minrun, descend);
+
+        // Restore the invariants on the lengths of the top runs:
+        // A > B + C, B > C (from the bottom up)
+        while (nr > 1) {
+            int i = nr - 2;
+            bool abc =
+                nr >= 3 && runs[i - 1].len <= runs[i].len + runs[i + 1].len;
+            bool bcd =
+                nr >= 4 && runs[i - 2].len <= runs[i - 1].len + runs[i].len;
+            if (abc || bcd) {
+                if (runs[i - 1].len < runs[i + 1].len)
+                    i--;
+            } else if (runs[i].len > runs[i + 1].len) {
+                break;
+            }
+            run_merge_at(runs, i, nr--, descend);
+        }
+    }
+
+    while (nr > 1) {
+        int i = nr - 2;
+        if (nr >= 3 && runs[nr - 3].len < runs[nr - 1].len)
+            i = nr - 3;
+        run_merge_at(runs, i, nr--, descend);
+    }
+    return runs[0].head;
+}
+
+/*
+ * MSD radix sort.
+ *
+ * Nodes are distributed by the byte of their string at the current depth into
+ * one bucket per byte value, each bucket being appended to in input order, so
+ * the sort is stable. The buckets are then concatenated in byte order, after
+ * sorting every bucket but that of the terminator on the next byte. When all
+ * nodes share the byte, the pass simply moves one byte deeper. The first
+ * Q_PREFIX_LEN bytes come from the cached prefix, so the strings themselves
+ * are only read past it.
+ *
+ * The bucket heads live on the stack. Buckets smaller than RADIX_MIN are
+ * finished by mergesort(), which also takes over beyond RADIX_DEPTH bytes, so
+ * the recursion and its stack usage stay bounded.
+ */
+
+#define RADIX_MIN 64
+#define RADIX_DEPTH 16
+
+/* Byte at depth d of the string of a node which has not ended before d */
+static inline unsigned radix_byte(const struct list_head *node, size_t d)
+{
+    const element_t *e = list_entry(node, element_t, list);
+
+    if (d < Q_PREFIX_LEN)
+        return (e->prefix >> (8 * (Q_PREFIX_LEN - 1 - d))) & 0xff;
+    return (unsigned char) e->value[d];
+}
+
+/* Sort a list of n nodes whose strings agree on the first depth bytes */
+static struct list_head *radix_pass(struct list_head *list,
+                                    size_t n,
+                                    size_t depth,
+                                    bool descend,
+                                    struct list_head **tailp)
+{
+    struct list_head *head[256], *tail[256];
+    size_t count[256];
+
+    for (;; depth++) {
+        if (n < RADIX_MIN || depth >= RADIX_DEPTH) {
+            list = mergesort(list, descend);
+            struct list_head *last = list;
+            while (last->next)
+                last = last->next;
+            *tailp = last;
+            return list;
+        }
+
+        unsigned lo = 255, hi = 0;
+        memset(count, 0, sizeof(count));
+        for (struct list_head *node = list; node; node = node->next) {
+            unsigned b = radix_byte(node, depth);
+            if (!count[b]++) {
+                head[b] = node;
+                lo = b < lo ? b : lo;
+                hi = b > hi ? b : hi;
+            } else {
+                tail[b]->next = node;
+            }
+            tail[b] = node;
+        }
+        if (lo == hi) {
+            tail[lo]->next = NULL;
+            if (!lo) {
+                // Every string ended here, so they are all equal
+                *tailp = tail[lo];
+                return list;
+            }
+            continue;
+        }
 
-    while (fast && fast->next) {
-        fast = fast->next->next;
-        slow = slow->next;
+        struct list_head *out = NULL, **link = &out;
+        for (unsigned i = lo; i <= hi; i++) {
+            unsigned b = descend ? lo + hi - i : i;
+            if (!count[b])
+                continue;
+
+            struct list_head *first = head[b], *last = tail[b];
+            last->next = NULL;
+            if (b && count[b] > 1)
+                first = radix_pass(first, count[b], depth + 1, descend, &last);
+            *link = first;
+            link = &last->next;
+            *tailp = last;
+        }
+        return out;
     }
-    // struct list_head* mid = slow;m
-    slow->prev->next = NULL;
+}
 
-    struct list_head *left = mergesort(head, descend);
-    struct list_head *right = mergesort(slow, descend);
+struct list_head *radixsort(struct list_head *list, size_t n, bool descend)
+{
+    struct list_head *tail;
 
-    return merge2SortedLists(left, right, descend);
-    // return left;
+    if (!list || !list->next)
+        return list;
+    return radix_pass(list, n, 0, descend, &tail);
 }
 
 struct list_head *merge2SortedLists(struct list_head *left,
@@ -312,14 +2512,10 @@ struct list_head *merge2SortedLists(struct list_head *left,
 {
     struct list_head *head = NULL;
     struct list_head **indir = &head;
-    int cmpr = descend ? -1 : 1;
 
     for (struct list_head **node = NULL; left && right;
          (*node) = (*node)->next) {
-        const element_t *l = list_entry(left, element_t, list);
-        const element_t *r = list_entry(right, element_t, list);
-        node = (cmpr * strcmp(l->value, r->value)) <= 0 ? &left : &right;
-
+        node = q_cmp(left, right, descend) <= 0 ? &left : &right;
 
         *indir = *node;
         indir = &(*indir)->next;
@@ -338,26 +2534,11 @@ int q_ascend(struct list_head *head)
 
     if (!head)
         return -1;
-    if (head->next == head)
-        return 0;
-    if (head->next == head->prev)
-        return 1;
-    element_t *standard, *compare, *safe;
-
-    for (standard = list_entry(head->prev, element_t, list),
-        compare = list_entry(standard->list.prev, element_t, list),
-        safe = list_entry(compare->list.prev, element_t, list);
-         &compare->list != head;
-         compare = safe, safe = list_entry(safe->list.prev, element_t, list)) {
-        if (strcmp(compare->value, standard->value) > 0) {
-            list_del(&compare->list);
-            q_release_element(compare);
-        } else {
-            standard = compare;
-        }
-    }
-
-    return q_size(head);
+    queue_t *q = q_header(head);
+    if (q->monotone != Q_MONO_ASCEND)
+        monotone_scan(q, false);
+    q_release_dropped(q);
+    return q->size;
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
@@ -367,27 +2548,24 @@ int q_descend(struct list_head *head)
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
     if (!head)
         return -1;
-    if (head->next == head)
-        return 0;
-    if (head->next == head->prev)
-        return 1;
-
-    element_t *standard, *compare, *safe;
-
-    for (standard = list_entry(head->prev, element_t, list),
-        compare = list_entry(standard->list.prev, element_t, list),
-        safe = list_entry(compare->list.prev, element_t, list);
-         &compare->list != head;
-         compare = safe, safe = list_entry(safe->list.prev, element_t, list)) {
-        if (strcmp(compare->value, standard->value) < 0) {
-            list_del(&compare->list);
-            q_release_element(compare);
-        } else {
-            standard = compare;
-        }
-    }
+    queue_t *q = q_header(head);
+    if (q->monotone != Q_MONO_DESCEND)
+        monotone_scan(q, true);
+    q_release_dropped(q);
+    return q->size;
+}
 
-    return q_size(head);
+/* Make queue keep an ascending or descending order by itself */
+int q_set_monotone(struct list_head *head, int order)
+{
+    if (!head || order < Q_MONO_NONE || order > Q_MONO_DESCEND)
+        return -1;
+
+    queue_t *q = q_header(head);
+    q->monotone = order;
+    q_keep_monotone(q);
+    q_release_dropped(q);
+    return q->size;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -401,34 +2579,44 @@ int q_merge(struct list_head *head, bool descend)
     if (head->next == head)
         return 0;
     if (head->next == head->prev)
-        return q_size(head->next);
-
-    int cmpr = descend ? -1 : 1;
-
-    struct list_head *first = head->next;
-    queue_contex_t *first_qctx = list_entry(first, queue_contex_t, chain);
-    for (struct list_head *next = first->next; next != head;
-         next = next->next) {
-        queue_contex_t *next_qctx = list_entry(next, queue_contex_t, chain);
-
-        struct list_head *cur = first_qctx->q->next;
-        //  *merged = next_qctx->q->next;
+        return q_size(list_entry(head->next, queue_contex_t, chain)->q);
+
+    /* Each queue is already a sorted sublist, so it is pushed on the same
+     * pending stack mergesort() uses for single nodes. Sublists are merged
+     * pairwise as the count of queues gains carries, which gives a balanced
+     * merge tree of depth log k and O(N log k) comparisons in total, with
+     * nothing allocated.
+     */
+    struct list_head *pending = NULL;
+    size_t count = 0;
+    int size = 0;
+    queue_contex_t *qctx;
 
-        while (cur != first_qctx->q && !list_empty(next_qctx->q)) {
-            const element_t *ele = list_entry(cur, element_t, list);
-            element_t *m_ele = list_first_entry(next_qctx->q, element_t, list);
+    list_for_each_entry (qctx, head, chain)
+        size += q_header(qctx->q)->size;
+    // Backend storage comes from q_reserve(), as nothing may be allocated
+    struct list_head *first = list_first_entry(head, queue_contex_t, chain)->q;
+    if (!q_has_room(q_header(first), size))
+        return -1;
 
-            if ((cmpr * strcmp(m_ele->value, ele->value)) <= 0) {
-                list_move(&m_ele->list, cur->prev);
-                cur = cur->prev;
-            } else {
-                cur = cur->next;
-            }
-        }
+    list_for_each_entry (qctx, head, chain) {
+        struct list_head *q = qctx->q;
 
-        list_splice_tail_init(next_qctx->q, first_qctx->q);
+        if (!q_header(q)->size)
+            continue;
+        q_unpack(q_header(q));
+        struct list_head *sublist = q_detach(q_header(q));
+        q_header(q)->size = 0;
+        pending = pending_push(pending, sublist, count++, descend);
     }
 
-
-    return q_size(list_entry(head->next, queue_contex_t, chain)->q);
+    if (pending)
+        list_relink(first, pending_collapse(pending, descend));
+    else
+        INIT_LIST_HEAD(first);
+    q_header(first)->size = size;
+    q_header(first)->reversed = false;
+    q_pack(q_header(first));
+    q_keep_monotone(q_header(first));
+    return q_header(first)->size;
 }
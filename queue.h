@@ -9,34 +9,134 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Strings up to this size, including the terminator, are stored inline */
+#define Q_INLINE_LEN 16
+
+/* Number of leading bytes of a string cached as an integer sort key */
+#define Q_PREFIX_LEN 8
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @prefix: first Q_PREFIX_LEN bytes of the string as a big-endian integer
+ * @inline_value: storage for a string short enough to live in the element
  *
- * @value needs to be explicitly allocated and freed
+ * @value points to @inline_value when the string fits, and to a separately
+ * allocated block otherwise. Both are released by q_release_element().
+ * @prefix is computed on insertion, so most comparisons are settled without
+ * reading the string.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t prefix;
+    char inline_value[Q_INLINE_LEN];
 } element_t;
 
+struct q_slab;
+struct q_slot;
+struct q_skip;
+
+/* Representations a queue can use */
+enum {
+    Q_LIST,     /* One doubly-linked node per element */
+    Q_UNROLLED, /* Chunks holding many element pointers each */
+    Q_RING,     /* One growable circular array of element pointers */
+    Q_INDEXED,  /* Skip list reaching any position in logarithmic time */
+    Q_BACKENDS,
+};
+
+/* Orders a queue can keep by itself, see q_set_monotone() */
+enum {
+    Q_MONO_NONE,
+    Q_MONO_ASCEND,  /* Always in the state q_ascend() would leave it in */
+    Q_MONO_DESCEND, /* Always in the state q_descend() would leave it in */
+};
+
+/**
+ * queue_t - The header of a queue
+ * @head: head of the circular doubly-linked list holding the elements
+ * @size: the number of elements in the queue
+ * @slabs: slabs the elements of this queue are carved from, newest first
+ * @free_slots: released element slots waiting for reuse
+ * @backend: representation of the queue, one of the Q_* backends
+ * @chunks: chunks of element pointers in queue order, for Q_UNROLLED
+ * @spare: empty chunks kept for reuse, for Q_UNROLLED
+ * @ring: circular array of element pointers, for Q_RING
+ * @ring_mask: number of slots in @ring minus one, a power of two minus one
+ * @ring_head: index in @ring of the first element, for Q_RING
+ * @reversed: the logical order is the reverse of the physical one
+ * @mid: a node of a Q_LIST queue kept near its middle, or NULL if unknown
+ * @mid_pos: physical position of @mid, counted from @head
+ * @skip: sentinel of the skip list, for Q_INDEXED
+ * @skip_top: number of skip list levels in use
+ * @skip_spare: unused skip list nodes kept for reuse
+ * @skip_seed: state of the generator drawing the levels of new nodes
+ * @monotone: order the queue keeps by itself, one of the Q_MONO_* values
+ * @dropped: elements the order of @monotone has pushed out, not released yet
+ *
+ * q_new() hands out the address of @head, so every operation on the queue
+ * reaches the rest of the header through container_of(). @size is kept up to
+ * date by every function which links or unlinks an element.
+ *
+ * Elements are bump-allocated from @slabs, which are ordinary harness blocks,
+ * so the leak accounting still sees every slab that holds a live element.
+ *
+ * A Q_UNROLLED queue keeps its order in @chunks, a Q_RING queue in @ring and a
+ * Q_INDEXED queue in @skip. They link their elements on @head only when asked
+ * to by q_link().
+ *
+ * Operations which may not free, such as q_reverse() or q_sort(), only move
+ * the elements a monotone queue loses onto @dropped. The next operation which
+ * frees anyway, an insertion, a deletion or q_free(), releases them.
+ *
+ * Insertion and removal at either end step @mid along, so it stays on the
+ * node q_delete_mid() removes and deleting the middle takes constant time.
+ * Operations which relink the nodes drop @mid, and the next insertion,
+ * removal or deletion finds the middle again from the nearer end.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct q_slab *slabs;
+    struct q_slot *free_slots;
+    int backend;
+    struct list_head chunks;
+    struct list_head spare;
+    element_t **ring;
+    unsigned ring_mask;
+    unsigned ring_head;
+    bool reversed;
+    struct list_head *mid;
+    int mid_pos;
+    struct q_skip *skip;
+    int skip_top;
+    struct q_skip *skip_spare;
+    uint32_t skip_seed;
+    int monotone;
+    struct list_head dropped;
+} queue_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
  * @chain: used by chaining the heads of queues
  * @size: the length of this queue
  * @id: the unique identification number
+ * @monotone: the Q_MONO_* order the queue keeps, so insertions may shrink it
  */
 typedef struct {
     struct list_head *q;
     struct list_head chain;
     int size;
     int id;
+    int monotone;
 } queue_contex_t;
 
 /* Operations on queue */
@@ -48,6 +148,40 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_backend() - Create an empty queue with the given representation
+ * @backend: one of the Q_* backends
+ *
+ * Every operation below works on a queue of any backend. q_new() creates a
+ * Q_LIST queue.
+ *
+ * Return: NULL for allocation failed or unknown backend
+ */
+struct list_head *q_new_backend(int backend);
+
+/**
+ * q_reserve() - Make room for a number of elements in advance
+ * @head: header of queue
+ * @n: number of elements the queue should be able to hold
+ *
+ * Q_UNROLLED, Q_RING and Q_INDEXED queues need bookkeeping storage besides
+ * their elements. Calling this before q_merge() lets the merge run without
+ * allocating. No effect on a Q_LIST queue.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_reserve(struct list_head *head, int n);
+
+/**
+ * q_link() - Link the elements of queue on its head for traversal
+ * @head: header of queue
+ *
+ * Queues other than Q_LIST do not keep the list nodes of their elements
+ * linked. After this call they can be walked with the helpers in list.h, until
+ * the queue is next modified. No effect on a Q_LIST queue.
+ */
+void q_link(struct list_head *head);
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -62,7 +196,9 @@ void q_free(struct list_head *head);
  * Argument s points to the string to be stored.
  * The function must explicitly allocate space and copy the string into it.
  *
- * Return: true for success, false for allocation failed or queue is NULL
+ * Return: true for success, false for allocation failed or queue is NULL.
+ * A monotone queue also returns false when @s would break its order, see
+ * q_set_monotone().
  */
 bool q_insert_head(struct list_head *head, char *s);
 
@@ -78,6 +214,23 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_bulk() - Insert many copies of a string at once
+ * @head: header of queue
+ * @s: string would be inserted
+ * @n: number of copies
+ * @tail: insert at the tail instead of the head
+ *
+ * Has the same effect as @n calls of q_insert_head() or q_insert_tail(), but
+ * the elements are built as a separate list first and spliced in at once.
+ * Either all @n copies are inserted or none is.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL.
+ * A monotone queue also returns false when the copies would break its order
+ * at the head.
+ */
+bool q_insert_bulk(struct list_head *head, char *s, int n, bool tail);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,26 +261,113 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_bulk() - Remove many elements from either end of queue at once
+ * @head: header of queue
+ * @out: list the removed elements are appended to
+ * @n: maximum number of elements to remove
+ * @tail: remove from the tail instead of the head
+ *
+ * The elements are appended to @out in the order they were removed, strings
+ * and all, so nothing is copied. The caller owns them afterwards and
+ * releases each with q_release_element().
+ *
+ * Return: the number of elements removed, which is less than @n only if the
+ * queue ran out, and 0 if queue is NULL.
+ */
+int q_remove_bulk(struct list_head *head,
+                  struct list_head *out,
+                  int n,
+                  bool tail);
+
+/**
+ * q_peek_head() - Get the element at head of queue without removing it
+ * @head: header of queue
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_peek_head(struct list_head *head);
+
+/**
+ * q_peek_tail() - Get the element at tail of queue without removing it
+ * @head: header of queue
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_peek_tail(struct list_head *head);
+
+/**
+ * q_at() - Get the element at a position of queue without removing it
+ * @head: header of queue
+ * @i: position of the element, 0 being the head
+ *
+ * A Q_INDEXED queue reaches any position in O(log n) and a Q_RING queue in
+ * constant time. The other backends walk from the nearer end.
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or @i is out of range.
+ */
+element_t *q_at(struct list_head *head, int i);
+
+/**
+ * q_insert_at() - Insert an element at a position of queue
+ * @head: header of queue
+ * @i: position the new element takes, from 0 to the size of the queue
+ * @s: string would be inserted
+ *
+ * Argument s points to the string to be stored, which is copied as for
+ * q_insert_head(). Elements from position @i onwards move one place back.
+ *
+ * Return: true for success, false for allocation failed, queue is NULL or @i
+ * is out of range.
+ */
+bool q_insert_at(struct list_head *head, int i, char *s);
+
+/**
+ * q_delete_at() - Delete the element at a position of queue
+ * @head: header of queue
+ * @i: position of the element, 0 being the head
+ *
+ * The element and its string are released.
+ *
+ * Return: true for success, false if queue is NULL or @i is out of range.
+ */
+bool q_delete_at(struct list_head *head, int i);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
- * This function is intended for internal use only.
+ * The slot holding @e goes back to the queue it was allocated from, and a
+ * string too long to be stored inline is freed. This function is intended
+ * for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The size is cached in the queue header, so this runs in constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
 
+/**
+ * q_footprint() - Get the memory held by the queue
+ * @head: header of queue
+ *
+ * Counts the bytes requested for the header, the slabs the queue owns, the
+ * storage of its backend including spares, and the strings of its elements
+ * which are not stored inline, including those of elements a monotone queue
+ * has removed but not released yet. Elements moved in by q_merge() stay in the
+ * slabs of the queue they came from, and are counted there. Runs in time
+ * linear in the number of elements.
+ *
+ * Return: the number of bytes, zero if queue is NULL
+ */
+size_t q_footprint(struct list_head *head);
+
 /**
  * q_delete_mid() - Delete the middle node in queue
  * @head: header of queue
@@ -136,6 +376,10 @@ int q_size(struct list_head *head);
  * ⌊n / 2⌋th node from the start using 0-based indexing.
  * If there're six elements, the third member should be returned.
  *
+ * Runs in constant time on a Q_LIST queue while it only changes at its ends
+ * and in the middle; the first call after an operation which relinked the
+ * nodes walks from the nearer end.
+ *
  * Reference:
  * https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
  *
@@ -155,6 +399,21 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_unsorted() - Delete all nodes that have duplicate string,
+ *                           wherever they are in the queue.
+ * @head: header of queue
+ *
+ * Unlike q_delete_dup(), the queue does not have to be sorted. Every string
+ * which occurs more than once is removed entirely, and the distinct strings
+ * keep their relative order. The queue is walked once with a hash table of
+ * string fingerprints, so this runs in linear expected time.
+ *
+ * Return: true for success, false if list is NULL or empty, or the hash
+ * table could not be allocated.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /**
  * q_swap() - Swap every two adjacent nodes
  * @head: header of queue
@@ -200,6 +459,38 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/* Engines q_sort() can use */
+enum {
+    Q_SORT_MERGE,    /* Bottom-up merge sort */
+    Q_SORT_ADAPTIVE, /* Natural merge sort, linear on presorted input */
+    Q_SORT_RADIX,    /* MSD radix sort on the bytes of the strings */
+    Q_SORT_ALGOS,
+};
+
+/**
+ * q_set_sort_algo() - Choose the engine used by q_sort()
+ * @algo: one of the Q_SORT_* values
+ *
+ * Every engine is stable and allocates no memory.
+ *
+ * Return: true for success, false if @algo is unknown
+ */
+bool q_set_sort_algo(int algo);
+
+/* Most threads q_sort() can use */
+#define Q_MAX_SORT_THREADS 16
+
+/**
+ * q_set_sort_threads() - Choose how many threads q_sort() uses
+ * @n: number of threads, 1 to sort on the calling thread only
+ *
+ * Large queues are cut into @n segments which are sorted concurrently and
+ * merged pairwise. Smaller queues are always sorted on the calling thread.
+ *
+ * Return: true for success, false if @n is out of range
+ */
+bool q_set_sort_threads(int n);
+
 /**
  * q_ascend() - Remove every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -212,6 +503,8 @@ void q_sort(struct list_head *head, bool descend);
  * Reference:
  * https://leetcode.com/problems/remove-nodes-from-linked-list/
  *
+ * Runs in constant time on a Q_MONO_ASCEND queue, which has nothing to remove.
+ *
  * Return: the number of elements in queue after performing operation
  */
 int q_ascend(struct list_head *head);
@@ -228,10 +521,34 @@ int q_ascend(struct list_head *head);
  * Reference:
  * https://leetcode.com/problems/remove-nodes-from-linked-list/
  *
+ * Runs in constant time on a Q_MONO_DESCEND queue, which has nothing to
+ * remove.
+ *
  * Return: the number of elements in queue after performing operation
  */
 int q_descend(struct list_head *head);
 
+/**
+ * q_set_monotone() - Make queue keep an ascending or descending order
+ * @head: header of queue
+ * @order: one of the Q_MONO_* values
+ *
+ * The queue is first reduced as by q_ascend() or q_descend(). From then on,
+ * inserting at the tail releases the elements before the new one which break
+ * the order, like pushing on a monotonic stack, in amortized constant time.
+ * An element inserted at the head which would break the order is released
+ * at once, and the insertion fails. Removals keep the order, and any
+ * other operation which may reorder the queue restores it with a full pass.
+ * Since q_reverse(), q_swap(), q_reverseK(), q_sort() and q_merge() must not
+ * call free(), the elements such a pass removes are released later, by the
+ * next insertion, deletion or q_free() on the queue. Q_MONO_NONE turns this
+ * off.
+ *
+ * Return: the number of elements in queue, -1 if queue is NULL or @order is
+ * unknown.
+ */
+int q_set_monotone(struct list_head *head, int order);
+
 /**
  * q_merge() - Merge all the queues into one sorted queue, which is in
  * ascending/descending order.
@@ -244,11 +561,14 @@ int q_descend(struct list_head *head);
  * in this function. There is no need to free the 'queue_contex_t' and its
  * member 'q' since they will be released externally. However, q_merge() is
  * responsible for making the queues to be NULL-queue, except the first one.
+ * Unless it is a Q_LIST queue, the first queue must have had room for every
+ * element reserved with q_reserve(); otherwise nothing is merged.
  *
  * Reference:
  * https://leetcode.com/problems/merge-k-sorted-lists/
  *
- * Return: the number of elements in queue after merging
+ * Return: the number of elements in queue after merging, -1 if the first
+ * queue has no room for them
  */
 int q_merge(struct list_head *head, bool descend);
 
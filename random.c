@@ -30,6 +30,10 @@
 
 #include "random.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -272,7 +276,8 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Read n bytes from the random source of the operating system */
+static int os_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +296,191 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/*
+ * Buffered pool
+ *
+ * Asking the operating system for every few bytes costs a system call each
+ * time, which dominates when qtest generates many random strings or dudect
+ * draws one class bit per measurement. randombytes() instead serves bytes
+ * from a ChaCha20 keystream (RFC 8439) kept in memory. Every refill of the
+ * buffer replaces the key with the first bytes of its own output, which are
+ * never handed out, so earlier output cannot be recomputed from the current
+ * state. The key comes afresh from the operating system after POOL_RESEED
+ * bytes, and in a child process after fork(). The pool is not locked: it is
+ * meant for a single thread.
+ */
+
+/* ChaCha20 blocks generated per refill */
+#define POOL_BLOCKS 16
+
+/* Bytes served before the key is drawn from the operating system again */
+#define POOL_RESEED (1 << 20)
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+static struct {
+    uint32_t state[16]; /* Constants, key, block counter and nonce */
+    uint8_t buf[64 * POOL_BLOCKS];
+    size_t avail;  /* Unread bytes at the end of buf */
+    size_t served; /* Bytes served since the key was last drawn */
+    bool seeded;
+} pool;
+
+static void chacha20_block(const uint32_t in[16], uint8_t out[64])
+{
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+/* A child must not replay the keystream its parent goes on to use */
+static void pool_forget(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+static int pool_refill(void)
+{
+    if (!pool.seeded || pool.served >= POOL_RESEED) {
+        static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32,
+                                          0x6b206574};
+        static bool registered = false;
+        uint8_t key[32];
+
+        if (os_randombytes(key, sizeof(key)))
+            return -1;
+        if (!registered) {
+            pthread_atfork(NULL, NULL, pool_forget);
+            registered = true;
+        }
+        memcpy(pool.state, sigma, sizeof(sigma));
+        memcpy(&pool.state[4], key, sizeof(key));
+        memset(key, 0, sizeof(key));
+        pool.served = 0;
+        pool.seeded = true;
+    }
+
+    memset(&pool.state[12], 0, 4 * sizeof(uint32_t));
+    for (int i = 0; i < POOL_BLOCKS; i++) {
+        chacha20_block(pool.state, pool.buf + 64 * i);
+        pool.state[12]++;
+    }
+
+    // The first 32 bytes become the next key and are never served
+    memcpy(&pool.state[4], pool.buf, 32);
+    memset(pool.buf, 0, 32);
+    pool.avail = sizeof(pool.buf) - 32;
+    return 0;
+}
+
+/*
+ * Workload generator
+ *
+ * xoshiro256** by David Blackman and Sebastiano Vigna, see
+ * <https://prng.di.unimi.it/>. It is not cryptographic, but it costs a few
+ * integer operations per 64 bits, so random string lengths and malloc failure
+ * injection can draw from it on every call. The state starts out as the
+ * splitmix64 expansion of 0, so it is never all zero even before seeding.
+ */
+static uint64_t xo[4] = {0xe220a8397b1dcdaf, 0x6e789e6aa1b965f4,
+                         0x06c45d188009454f, 0xf88bb8a8724c81ec};
+
+/* Serve randombytes() from xo[] instead of the pool */
+static bool replay = false;
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void rand_seed(uint64_t seed, bool reproducible)
+{
+    /* Expand the seed with splitmix64, as recommended by the authors */
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        xo[i] = z ^ (z >> 31);
+    }
+    replay = reproducible;
+}
+
+uint64_t rand_next(void)
+{
+    uint64_t result = rotl64(xo[1] * 5, 7) * 9;
+    uint64_t t = xo[1] << 17;
+
+    xo[2] ^= xo[0];
+    xo[3] ^= xo[1];
+    xo[1] ^= xo[2];
+    xo[0] ^= xo[3];
+    xo[2] ^= t;
+    xo[3] = rotl64(xo[3], 45);
+    return result;
+}
+
+static void replay_bytes(uint8_t *buf, size_t n)
+{
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+        uint64_t v = rand_next();
+        memcpy(buf, &v, sizeof(v));
+        buf += sizeof(v);
+    }
+    if (n) {
+        uint64_t v = rand_next();
+        memcpy(buf, &v, n);
+    }
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if (replay) {
+        replay_bytes(buf, n);
+        return 0;
+    }
+
+    while (n > 0) {
+        if (!pool.avail && pool_refill())
+            return -1;
+
+        size_t take = n < pool.avail ? n : pool.avail;
+        uint8_t *src = pool.buf + sizeof(pool.buf) - pool.avail;
+        memcpy(buf, src, take);
+        memset(src, 0, take);
+        pool.avail -= take;
+        pool.served += take;
+        buf += take;
+        n -= take;
+    }
+    return 0;
+}
@@ -1,11 +1,21 @@
 #ifndef LAB0_RANDOM_H
 #define LAB0_RANDOM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Reseed the fast workload generator. When reproducible is set, randombytes()
+ * is served from the same generator too, so every random choice of a run
+ * follows from the seed alone.
+ */
+extern void rand_seed(uint64_t seed, bool reproducible);
+
+/* Next 64 bits from the workload generator */
+extern uint64_t rand_next(void);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
@@ -197,6 +197,18 @@ static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
 
+void mem_usage(size_t *current, size_t *peak, size_t *last_peak)
+{
+    *current = current_bytes;
+    *peak = peak_bytes;
+    *last_peak = last_peak_bytes;
+}
+
+void reset_peak_bytes()
+{
+    last_peak_bytes = current_bytes;
+}
+
 static void check_exceed(size_t new_bytes)
 {
     size_t limit_bytes = (size_t) mblimit << 20;
@@ -26,6 +26,14 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Bytes held by blocks from malloc_or_fail and its kin: now, at most ever, and
+ * at most since the last reset_peak_bytes
+ */
+void mem_usage(size_t *current, size_t *peak, size_t *last_peak);
+
+/* Restart the last peak from the bytes held now */
+void reset_peak_bytes();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
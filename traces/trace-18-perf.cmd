@@ -0,0 +1,17 @@
+# Test performance of insert, reverse and sort under the perf harness tier,
+# which leaves out block guards and poisoning
+option fail 0
+option malloc 0
+option harness 0
+new
+ih dolphin 1000000
+it gerbil 1000000
+reverse
+sort
+free
+new
+ih RAND 100000
+sort
+reverse
+sort
+free
@@ -0,0 +1,23 @@
+# Test operations with every allocation that fits in a page placed against
+# a guard page, so an access past a block or to a freed one faults at once
+option fail 0
+option malloc 0
+option guard 1
+new
+ih aardvark-with-a-long-name 10
+it zebra-with-an-even-longer-name 10
+ih RAND 100
+reverse
+sort
+reverseK 3
+swap
+dm
+dedup
+rh
+rt
+sort
+new
+it gerbil-with-a-long-name 300
+merge
+mem
+free
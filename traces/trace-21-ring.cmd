@@ -0,0 +1,63 @@
+# Test of sort, reverse, reverseK, dedup and merge on the ring backend
+option fail 0
+option malloc 0
+option backend 2
+new
+ih b 70
+ih a 70
+it c 70
+ih d
+reverse
+sort
+dedup
+rh d
+ih a
+it b
+it c
+it d
+it e
+it f
+it g
+reverse
+reverseK 3
+rh e
+rh f
+rh g
+rt a
+rt d
+rh b
+rh c
+ih a 3
+ih b
+ih c
+ih d
+ih e 2
+reverseK 3
+rh d
+rh e
+rh e
+rh a
+rh b
+rh c
+rh a
+rh a
+new
+ih r
+ih c
+ih z
+sort
+new
+it m
+it n
+it a
+reverse
+sort
+merge
+reverse
+rh z
+rh r
+rt a
+rt c
+rh n
+rh m
+free
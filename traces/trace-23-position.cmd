@@ -0,0 +1,33 @@
+# Test of at, ins, del, delete_mid, remove_head and remove_tail
+option fail 0
+option malloc 0
+new
+ih c
+ih b
+ih a
+it d
+it e
+at 2 c
+ins 0 x
+ins 6 y
+ins 3 m
+del 1
+reverse
+del 0
+ins 2 k
+at 3 c
+dm
+dm
+rh e
+rt x
+it f 3
+dm 2
+at 0 d
+at 3 f
+at 5
+del 5
+reverse
+rh f
+rt d
+rt m
+free
@@ -0,0 +1,44 @@
+# Test of sort with the timsort and radix sort engines, in both orders
+option fail 0
+option malloc 0
+option sortalgo 1
+new
+ih RAND 1000
+it RAND 1000
+sort
+reverse
+sort
+option descend 1
+sort
+free
+option descend 0
+new
+it gerbil 40
+it dolphin 40
+ih jaguar 40
+sort
+rh dolphin 40
+rt jaguar 40
+free
+option sortalgo 2
+new
+ih RAND 1000
+it RAND 1000
+sort
+reverse
+sort
+option descend 1
+sort
+free
+option descend 0
+new
+it radix-shared-prefix-b
+it radix-shared-prefix
+it radix-shared-prefix-a
+ih radix
+sort
+rh radix
+rh radix-shared-prefix
+rh radix-shared-prefix-a
+rh radix-shared-prefix-b
+free
@@ -0,0 +1,40 @@
+# Test of queues keeping the order of ascend or descend on every insertion
+option fail 0
+option malloc 0
+new
+it d
+it b
+it e
+it a
+it c
+monotone ascend
+it b
+ih z
+ih A
+it c
+rh A
+rh a
+rh b
+rh c
+it a
+it d
+it b
+it c
+monotone descend
+it e
+ih B
+ih z
+it a
+rh z
+rh e
+rt a
+it c
+it a
+reverse
+rh c
+monotone off
+ih a
+it z
+rh a
+rt z
+free
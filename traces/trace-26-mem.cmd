@@ -0,0 +1,20 @@
+# Test of memory reports, per queue and in the queue footer
+option fail 0
+option malloc 0
+option memstats 1
+new
+ih a-string-too-long-to-be-inline 10
+it b 10
+new unrolled
+it RAND 100
+new ring
+it RAND 100
+new indexed
+it RAND 100
+mem
+mem reset
+free
+free
+free
+free
+mem
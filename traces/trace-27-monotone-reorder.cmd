@@ -0,0 +1,84 @@
+# Test of reverse, swap, reverseK, sort and merge on queues keeping an order
+option fail 0
+option malloc 0
+new
+it a
+new
+it b
+merge
+monotone ascend
+reverse
+rh a
+it apple-tree-with-a-long-name
+it banana-tree-with-a-long-name
+it cherry-tree-with-a-long-name
+it damson-tree-with-a-long-name
+swap
+rh apple-tree-with-a-long-name
+rh cherry-tree-with-a-long-name
+it e
+it f
+it g
+it h
+reverseK 3
+rh e
+rh h
+monotone off
+it a
+it z
+it m
+monotone descend
+it b
+sort
+rh z
+it y
+rt y
+free
+new
+it b
+it d
+it f
+new
+it a
+it c
+it e
+monotone ascend
+merge
+rh a
+rh b
+rt f
+free
+new unrolled
+it m 70
+it n 70
+monotone ascend
+reverse
+rh m 70
+it a 70
+it p 70
+swap
+sort
+rh a 70
+rt p 70
+free
+new ring
+it x
+it y
+monotone ascend
+reverse
+it z
+rh x
+rt z
+free
+new indexed
+it x
+it y
+it w
+monotone descend
+sort
+rh y
+it w
+it v
+reverse
+rh w
+free